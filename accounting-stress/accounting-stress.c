@@ -1,13 +1,11 @@
 #define _GNU_SOURCE
 #include <errno.h>
-#include <libgen.h>
 #include <fcntl.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/capability.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
@@ -17,18 +15,22 @@
 #include <sys/wait.h>
 
 #include <linux/ioctl.h>
+#include <linux/iommufd.h>
 #include <linux/vfio.h>
 
+#include "../utils.h"
+
 #define MAP_SIZE (4 * 1024)
 #define MLOCK_SIZE (4 * 1024)
+#define FAULT_SIZE (2 * 1024 * 1024)
 #define STACK_SIZE (1024 * 1024)
+#define MAX_THREADS 256
+#define MAX_LEVELS 32
 
-static int stop = 0;
+static volatile int stop = 0;
 
 static int mlock_loop(void *buf)
 {
-	printf("Mlock thread starting\n");
-
 	while (!stop) {
 		if (mlock(buf, MLOCK_SIZE)) {
 			printf("mlock failed: %m\n");
@@ -41,32 +43,211 @@ static int mlock_loop(void *buf)
 	return 0;
 }
 
-static void usage(char *name)
+/*
+ * Fault in unrelated anonymous memory in the same mm, then zap it so the
+ * next pass faults again, as a vCPU touching guest RAM would.
+ */
+static int fault_loop(void *buf)
 {
-	printf("usage: %s ssss:bb:dd.f\n", name);
-	printf("\tssss: PCI segment, ex. 0000\n");
-	printf("\tbb:   PCI bus, ex. 01\n");
-	printf("\tdd:   PCI device, ex. 06\n");
-	printf("\tf:    PCI function, ex. 0\n");
+	long pagesize = getpagesize();
+	volatile char *p;
+
+	while (!stop) {
+		for (p = buf; p < (char *)buf + FAULT_SIZE; p += pagesize)
+			*p = 1;
+
+		if (madvise(buf, FAULT_SIZE, MADV_DONTNEED))
+			printf("madvise(MADV_DONTNEED) failed: %m\n");
+	}
+
+	return 0;
 }
 
-int main(int argc, char **argv)
-{
-	int seg, bus, slot, func;
-	int ret, container, group, groupid;
-	char path[50], iommu_group_path[50], *group_name;
-	struct stat st;
-	ssize_t len;
-	void *map_buf, *mlock_buf, *stack;
+struct contender {
 	pid_t pid;
-	long i = 0;
+	void *stack;
+	void *buf;
+};
 
-	struct vfio_group_status group_status = {
-		.argsz = sizeof(group_status)
-	};
+static int contender_start(struct contender *c, int (*fn)(void *),
+			   size_t size)
+{
+	c->buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c->buf == MAP_FAILED) {
+		printf("Failed to mmap contender buffer\n");
+		return -1;
+	}
+
+	/* Keep fault threads on 4K faults regardless of THP defaults */
+	madvise(c->buf, size, MADV_NOHUGEPAGE);
+
+	c->stack = malloc(STACK_SIZE);
+	if (!c->stack) {
+		printf("Failed to alloc thread stack\n");
+		goto out_unmap;
+	}
+
+	c->pid = clone(fn, c->stack + STACK_SIZE, CLONE_VM | SIGCHLD, c->buf);
+	if (c->pid == -1) {
+		printf("Failed to clone thread\n");
+		goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	free(c->stack);
+out_unmap:
+	munmap(c->buf, size);
+	return -1;
+}
+
+static void contender_stop(struct contender *c, size_t size)
+{
+	waitpid(c->pid, NULL, 0);
+	free(c->stack);
+	munmap(c->buf, size);
+}
+
+/*
+ * A DMA mapping backend reduced to the pair of ioctls the loop issues, so
+ * type1 and iommufd are timed through identical code.
+ */
+struct backend {
+	const char *name;
+	int fd;
+	unsigned long map_cmd;
+	void *map_arg;
+	unsigned long unmap_cmd;
+	void *unmap_arg;
+};
+
+struct result {
+	int nr_mlock;
+	int nr_fault;
+	unsigned long iterations;
+	unsigned long nsecs;
+	unsigned long p99;
+	struct lat_stats lat;
+};
+
+static int run_level(struct backend *b, unsigned long duration,
+		     struct result *res)
+{
+	struct contender mlockers[MAX_THREADS], faulters[MAX_THREADS];
+	unsigned long start, end, before, after;
+	int i, nr_mlock = 0, nr_fault = 0, ret = 0;
+
+	if (lat_stats_init(&res->lat, 1024 * 1024))
+		return -1;
+
+	stop = 0;
+
+	/* Contenders are processes, those started must be reaped on error */
+	for (; nr_mlock < res->nr_mlock; nr_mlock++) {
+		if (contender_start(&mlockers[nr_mlock], mlock_loop,
+				    MLOCK_SIZE)) {
+			ret = -1;
+			goto out_stop;
+		}
+	}
+
+	for (; nr_fault < res->nr_fault; nr_fault++) {
+		if (contender_start(&faulters[nr_fault], fault_loop,
+				    FAULT_SIZE)) {
+			ret = -1;
+			goto out_stop;
+		}
+	}
+
+	start = before = now_nsec();
+	end = start + duration;
+
+	while (before < end) {
+		if (ioctl(b->fd, b->map_cmd, b->map_arg)) {
+			printf("Failed to map memory (%m)\n");
+			ret = -1;
+			break;
+		}
+
+		if (ioctl(b->fd, b->unmap_cmd, b->unmap_arg)) {
+			printf("Failed to unmap memory (%m)\n");
+			ret = -1;
+			break;
+		}
+
+		after = now_nsec();
+		lat_stats_add(&res->lat, after - before);
+		res->iterations++;
+		before = after;
+	}
+
+	res->nsecs = before - start;
+	res->p99 = lat_stats_pct(&res->lat, 99);
+
+out_stop:
+	stop = 1;
+
+	for (i = 0; i < nr_mlock; i++)
+		contender_stop(&mlockers[i], MLOCK_SIZE);
+
+	for (i = 0; i < nr_fault; i++)
+		contender_stop(&faulters[i], FAULT_SIZE);
+
+	return ret;
+}
+
+static double ops_per_sec(struct result *res)
+{
+	return res->nsecs ? (double)res->iterations * NSEC_PER_SEC / res->nsecs : 0;
+}
+
+static void print_result(struct result *res, struct result *base)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "mlock %d fault %d:",
+		 res->nr_mlock, res->nr_fault);
+
+	printf("%-20s %10.0f ops/s", name, ops_per_sec(res));
+	if (res != base && ops_per_sec(base))
+		printf(" (%5.1f%% of baseline, p99 x%.2f)",
+		       100 * ops_per_sec(res) / ops_per_sec(base),
+		       (double)res->p99 / base->p99);
+	printf("\n");
+	lat_stats_print("map+unmap", &res->lat);
+}
+
+/* Run the whole contention sweep against one backend */
+static int run_backend(struct backend *b, unsigned long duration,
+		       struct result *results, int nr_results)
+{
+	int i;
+
+	printf("%s: running %d contention levels, %lds each\n",
+	       b->name, nr_results, duration / NSEC_PER_SEC);
+
+	for (i = 0; i < nr_results; i++) {
+		if (run_level(b, duration, &results[i]))
+			return -1;
+
+		print_result(&results[i], &results[0]);
+		fflush(stdout);
+		lat_stats_free(&results[i].lat);
+	}
+
+	return 0;
+}
+
+static int type1_backend(const char *devname, void *buf,
+			 unsigned long duration,
+			 struct result *results, int nr_results)
+{
 	struct vfio_iommu_type1_dma_map dma_map = {
 		.argsz = sizeof(dma_map),
 		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.vaddr = (unsigned long)buf,
 		.size = MAP_SIZE,
 		.iova = 0,
 	};
@@ -75,84 +256,189 @@ int main(int argc, char **argv)
 		.size = MAP_SIZE,
 		.iova = 0,
 	};
+	struct backend b = {
+		.name = "type1v2",
+		.map_cmd = VFIO_IOMMU_MAP_DMA,
+		.map_arg = &dma_map,
+		.unmap_cmd = VFIO_IOMMU_UNMAP_DMA,
+		.unmap_arg = &dma_unmap,
+	};
+	int group, ret;
 
-	if (argc != 2) {
-		usage(argv[0]);
+	if (vfio_device_attach_iommu_type(devname, &b.fd, NULL, &group,
+					  VFIO_TYPE1v2_IOMMU))
 		return -1;
-	}
 
-	/* Boilerplate vfio setup */
-	ret = sscanf(argv[1], "%04x:%02x:%02x.%d", &seg, &bus, &slot, &func);
-	if (ret != 4) {
-		usage(argv[0]);
-		return -1;
-	}
+	ret = run_backend(&b, duration, results, nr_results);
 
-	container = open("/dev/vfio/vfio", O_RDWR);
-	if (container < 0) {
-		printf("Failed to open /dev/vfio/vfio, %d (%s)\n",
-		       container, strerror(errno));
-		return container;
-	}
+	/* The group must be released before the device cdev can be bound */
+	close(group);
+	close(b.fd);
+	return ret;
+}
+
+static int iommufd_backend(const char *devname, void *buf,
+			   unsigned long duration, int rlimit_mode,
+			   struct result *results, int nr_results)
+{
+	struct iommu_option option = {
+		.size = sizeof(option),
+		.option_id = IOMMU_OPTION_RLIMIT_MODE,
+		.op = IOMMU_OPTION_OP_SET,
+		.val64 = rlimit_mode,
+	};
+	struct iommu_ioas_map map = {
+		.size = sizeof(map),
+		.flags = IOMMU_IOAS_MAP_READABLE | IOMMU_IOAS_MAP_WRITEABLE |
+			 IOMMU_IOAS_MAP_FIXED_IOVA,
+		.user_va = (unsigned long)buf,
+		.length = MAP_SIZE,
+		.iova = 0,
+	};
+	struct iommu_ioas_unmap unmap = {
+		.size = sizeof(unmap),
+		.length = MAP_SIZE,
+		.iova = 0,
+	};
+	struct backend b = {
+		.name = rlimit_mode ? "iommufd per-process" : "iommufd per-user",
+		.map_cmd = IOMMU_IOAS_MAP,
+		.map_arg = &map,
+		.unmap_cmd = IOMMU_IOAS_UNMAP,
+		.unmap_arg = &unmap,
+	};
+	unsigned int ioas;
+	int device, ret;
 
-	snprintf(path, sizeof(path),
-		 "/sys/bus/pci/devices/%04x:%02x:%02x.%01x/",
-		 seg, bus, slot, func);
+	b.fd = iommufd_open();
+	if (b.fd < 0)
+		return -1;
 
-	ret = stat(path, &st);
-	if (ret < 0) {
-		printf("No such device\n");
-		return  ret;
+	/* Accounting mode can only change while the context has no objects */
+	if (ioctl(b.fd, IOMMU_OPTION, &option)) {
+		printf("%s: failed to set IOMMU_OPTION_RLIMIT_MODE (%m), "
+		       "skipping\n", b.name);
+		close(b.fd);
+		return 0;
 	}
 
-	strncat(path, "iommu_group", sizeof(path) - strlen(path) - 1);
-
-	len = readlink(path, iommu_group_path, sizeof(iommu_group_path));
-	if (len <= 0) {
-		printf("No iommu_group for device\n");
+	if (vfio_device_iommufd_attach(devname, b.fd, &device, &ioas)) {
+		close(b.fd);
 		return -1;
 	}
 
-	iommu_group_path[len] = 0;
-	group_name = basename(iommu_group_path);
+	map.ioas_id = unmap.ioas_id = ioas;
 
-	if (sscanf(group_name, "%d", &groupid) != 1) {
-		printf("Unknown group\n");
-		return -1;
-	}
+	ret = run_backend(&b, duration, results, nr_results);
 
-	snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
-	group = open(path, O_RDWR);
-	if (group < 0) {
-		printf("Failed to open %s, %d (%s)\n",
-		       path, group, strerror(errno));
-		return group;
-	}
+	close(device);
+	close(b.fd);
+	return ret;
+}
 
-	ret = ioctl(group, VFIO_GROUP_GET_STATUS, &group_status);
-	if (ret) {
-		printf("ioctl(VFIO_GROUP_GET_STATUS) failed\n");
-		return ret;
+static void print_summary(const char **names,
+			  struct result results[][MAX_LEVELS],
+			  int nr_backends, int nr_results)
+{
+	int i, j;
+
+	printf("\nSummary, ops/s (p99 us):\n");
+	printf("%-20s", "");
+	for (j = 0; j < nr_backends; j++)
+		printf(" %22s", names[j]);
+	printf("\n");
+
+	for (i = 0; i < nr_results; i++) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "mlock %d fault %d:",
+			 results[0][i].nr_mlock, results[0][i].nr_fault);
+		printf("%-20s", name);
+
+		for (j = 0; j < nr_backends; j++) {
+			struct result *res = &results[j][i];
+
+			if (!res->iterations) {
+				printf(" %22s", "-");
+				continue;
+			}
+			printf(" %10.0f (%9.3f)", ops_per_sec(res),
+			       res->p99 / 1000.0);
+		}
+		printf("\n");
 	}
+}
 
-	if (!(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
-		printf("Group not viable, are all devices attached to vfio?\n");
-		return -1;
+/* 1, 2, 4... max, then 0 to terminate the sweep */
+static int next_level(int n, int max)
+{
+	if (n >= max)
+		return 0;
+	return n * 2 > max ? max : n * 2;
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [-b backend] [-d seconds] [-m mlock threads] "
+	       "[-f fault threads] ssss:bb:dd.f\n", name);
+	printf("\tssss: PCI segment, ex. 0000\n");
+	printf("\tbb:   PCI bus, ex. 01\n");
+	printf("\tdd:   PCI device, ex. 06\n");
+	printf("\tf:    PCI function, ex. 0\n");
+	printf("\t-b:   type1, iommufd-user, iommufd-process or all (default)\n");
+	printf("\t-d:   seconds per contention level, default 5\n");
+	printf("\t-m:   max competing mlock/munlock threads, default 1\n");
+	printf("\t-f:   max threads faulting unrelated memory, default 0\n");
+	printf("Contention levels sweep 1, 2, 4... up to the given thread counts\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname, *backend = "all";
+	const char *names[3];
+	void *map_buf;
+	unsigned long duration = 5 * NSEC_PER_SEC;
+	int nr_mlock = 1, nr_fault = 0;
+	static struct result results[3][MAX_LEVELS];
+	struct result levels[MAX_LEVELS] = { 0 };
+	int nr_results = 0, nr_backends = 0;
+	int i, n, opt;
+
+	while ((opt = getopt(argc, argv, "b:d:m:f:")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'd':
+			duration = strtoul(optarg, NULL, 0) * NSEC_PER_SEC;
+			break;
+		case 'm':
+			nr_mlock = atoi(optarg);
+			break;
+		case 'f':
+			nr_fault = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
 	}
 
-	ret = ioctl(group, VFIO_GROUP_SET_CONTAINER, &container);
-	if (ret) {
-		printf("Failed to set group container\n");
-		return ret;
+	if (optind != argc - 1 || !duration ||
+	    nr_mlock < 0 || nr_mlock > MAX_THREADS ||
+	    nr_fault < 0 || nr_fault > MAX_THREADS) {
+		usage(argv[0]);
+		return -1;
 	}
 
-	ret = ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1v2_IOMMU);
-	if (ret) {
-		printf("Failed to set IOMMU\n");
-		return ret;
+	if (strcmp(backend, "all") && strcmp(backend, "type1") &&
+	    strcmp(backend, "iommufd-user") &&
+	    strcmp(backend, "iommufd-process")) {
+		usage(argv[0]);
+		return -1;
 	}
 
-	printf("vfio initialized\n");
+	devname = argv[optind];
 
 	map_buf = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE,
 		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -161,56 +447,45 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	dma_map.vaddr = (unsigned long)map_buf;
+	/* Uncontended baseline first, then each contention level */
+	levels[nr_results++] = (struct result){ 0 };
 
-	printf("DMA buffer allocated\n");
-	
-	mlock_buf = mmap(NULL, MLOCK_SIZE, PROT_READ | PROT_WRITE,
-			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (mlock_buf == MAP_FAILED) {
-		printf("Failed to mmap mlock buffer\n");
-		return -1;
-	}
+	for (n = nr_mlock ? 1 : 0; n; n = next_level(n, nr_mlock))
+		levels[nr_results++] = (struct result){ .nr_mlock = n };
 
-	printf("mlock buffer allocated\n");
+	for (n = nr_fault ? 1 : 0; n; n = next_level(n, nr_fault))
+		levels[nr_results++] = (struct result){ .nr_fault = n };
 
-	stack = malloc(STACK_SIZE);
-	if (!stack) {
-		printf("Failed to alloc thread stack\n");
-		return -1;
-	}
+	if (nr_mlock && nr_fault)
+		levels[nr_results++] = (struct result){ .nr_mlock = nr_mlock,
+							.nr_fault = nr_fault };
 
-	printf("thread stack allocated\n");
+	for (i = 0; i < 3; i++)
+		memcpy(results[i], levels, sizeof(levels));
 
-	pid = clone(mlock_loop,
-		    stack + STACK_SIZE, CLONE_VM | SIGCHLD, mlock_buf);
-	if (pid == -1) {
-		printf("Failed to clone thread\n");
-		return -1;
+	if (!strcmp(backend, "all") || !strcmp(backend, "type1")) {
+		names[nr_backends] = "type1v2";
+		if (type1_backend(devname, map_buf, duration,
+				  results[nr_backends++], nr_results))
+			return -1;
 	}
 
-	printf("Main thread commencing DMA mapping loop\n");
-
-	while (1) {
-		if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
-			printf("Failed to map memory (%m)\n");
-			break;
-		}
+	if (!strcmp(backend, "all") || !strcmp(backend, "iommufd-user")) {
+		names[nr_backends] = "iommufd per-user";
+		if (iommufd_backend(devname, map_buf, duration, 0,
+				    results[nr_backends++], nr_results))
+			return -1;
+	}
 
-		if (ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap)) {
-			printf("Failed to unmap memory (%m)\n");
-			break;
-		}
-		i++;
-		if (!(i % 10000)) {
-			printf(".");
-			fflush(stdout);
-		}
+	if (!strcmp(backend, "all") || !strcmp(backend, "iommufd-process")) {
+		names[nr_backends] = "iommufd per-process";
+		if (iommufd_backend(devname, map_buf, duration, 1,
+				    results[nr_backends++], nr_results))
+			return -1;
 	}
 
-	printf("Iteration count: %ld\n", i);
-	stop = 1;
-	waitpid(pid, NULL, 0);
+	if (nr_backends > 1)
+		print_summary(names, results, nr_backends, nr_results);
 
 	return 0;
 }
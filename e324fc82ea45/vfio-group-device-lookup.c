@@ -0,0 +1,245 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "../utils.h"
+
+#define DEFAULT_ITERATIONS 10000
+#define DEFAULT_THREADS 8
+#define MAX_THREADS 256
+#define BOGUS_NAME "THIS-IS-NOT-THE-RIGHT-NAME"
+
+void usage(char *name)
+{
+	printf("usage: %s [-t threads] [-n iterations] ssss:bb:dd.f ...\n",
+	       name);
+	printf("\t-t:   max threads, sweeps 1, 2, 4..., default %d\n",
+	       DEFAULT_THREADS);
+	printf("\t-n:   lookups per thread, default %d\n", DEFAULT_ITERATIONS);
+	printf("\tDevices must be in separate IOMMU groups\n");
+}
+
+/*
+ * Group lookups go through VFIO_GROUP_GET_DEVICE_FD on a shared group fd,
+ * valid names return a new device fd which is closed again, invalid names
+ * walk the group's device list and fail.  A reference device fd is held
+ * throughout so valid lookups don't include enabling the device.  The cdev
+ * equivalent is an open and close of /dev/vfio/devices/vfioX.  There's no
+ * invalid cdev case, a name that doesn't exist fails in the VFS path walk
+ * without ever reaching vfio.
+ */
+enum op { OP_GROUP_VALID, OP_GROUP_INVALID, OP_CDEV_VALID, NR_OPS };
+
+static const char *op_names[] = {
+	"group valid", "group invalid", "cdev valid"
+};
+
+struct lookup {
+	int group;
+	const char *name;
+	const char *cdev;
+	enum op op;
+	unsigned long iterations;
+	pthread_barrier_t barrier;
+};
+
+struct worker {
+	pthread_t thread;
+	struct lookup *lookup;
+	unsigned long failed;
+	struct lat_stats lat;
+};
+
+static void *lookup_func(void *arg)
+{
+	struct worker *w = arg;
+	struct lookup *l = w->lookup;
+	unsigned long i, before;
+	int fd;
+
+	pthread_barrier_wait(&l->barrier);
+
+	for (i = 0; i < l->iterations; i++) {
+		before = now_nsec();
+		switch (l->op) {
+		case OP_GROUP_VALID:
+		case OP_GROUP_INVALID:
+			fd = ioctl(l->group, VFIO_GROUP_GET_DEVICE_FD, l->name);
+			break;
+		default:
+			fd = open(l->cdev, O_RDWR);
+			break;
+		}
+		if (fd >= 0)
+			close(fd);
+		lat_stats_add(&w->lat, now_nsec() - before);
+
+		/* Count unexpected results, the invalid case should fail */
+		if ((fd >= 0) == (l->op == OP_GROUP_INVALID))
+			w->failed++;
+	}
+
+	return NULL;
+}
+
+static int run(struct lookup *l, int nr_threads)
+{
+	struct worker workers[MAX_THREADS];
+	unsigned long before, nsecs, failed = 0, i;
+	struct lat_stats lat;
+	char name[32];
+	int t;
+
+	pthread_barrier_init(&l->barrier, NULL, nr_threads + 1);
+
+	for (t = 0; t < nr_threads; t++) {
+		workers[t] = (struct worker){ .lookup = l };
+		lat_stats_init(&workers[t].lat, l->iterations);
+		if (pthread_create(&workers[t].thread, NULL,
+				   lookup_func, &workers[t])) {
+			printf("Failed to create thread %d\n", t);
+			exit(-1);
+		}
+	}
+
+	before = now_nsec();
+	pthread_barrier_wait(&l->barrier);
+
+	lat_stats_init(&lat, l->iterations * nr_threads);
+
+	for (t = 0; t < nr_threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		failed += workers[t].failed;
+		for (i = 0; i < workers[t].lat.count; i++)
+			lat_stats_add(&lat, workers[t].lat.samples[i]);
+		lat_stats_free(&workers[t].lat);
+	}
+
+	nsecs = now_nsec() - before;
+	pthread_barrier_destroy(&l->barrier);
+
+	snprintf(name, sizeof(name), "%s x%d", op_names[l->op], nr_threads);
+	printf("\t%-20s %10.0f lookups/s%s\n", name,
+	       (double)lat.count * NSEC_PER_SEC / nsecs,
+	       failed ? " (unexpected results)" : "");
+	lat_stats_print("latency", &lat);
+	fflush(stdout);
+
+	lat_stats_free(&lat);
+	return 0;
+}
+
+/* Number of devices sharing the IOMMU group */
+static int group_devices(const char *devname)
+{
+	char path[PATH_MAX];
+	struct dirent *dent;
+	int count = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path),
+		 "/sys/bus/pci/devices/%s/iommu_group/devices", devname);
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((dent = readdir(dir)))
+		if (dent->d_name[0] != '.')
+			count++;
+
+	closedir(dir);
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	int container, group, device;
+	int opt, d, t, max_threads = DEFAULT_THREADS;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	char cdev[PATH_MAX];
+	struct lookup l;
+	enum op op;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind == argc || max_threads < 1 || max_threads > MAX_THREADS ||
+	    !iterations) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (d = optind; d < argc; d++) {
+		if (vfio_device_attach(argv[d], &container, &device, &group))
+			return -1;
+
+		if (vfio_device_cdev_path(argv[d], cdev, sizeof(cdev)))
+			cdev[0] = 0;
+
+		printf("%s: %d device(s) in group\n", argv[d],
+		       group_devices(argv[d]));
+
+		for (op = OP_GROUP_VALID; op < NR_OPS; op++) {
+			l = (struct lookup){
+				.group = group,
+				.op = op,
+				.iterations = iterations,
+			};
+
+			switch (op) {
+			case OP_GROUP_VALID:
+				l.name = argv[d];
+				break;
+			case OP_GROUP_INVALID:
+				l.name = BOGUS_NAME;
+				break;
+			default:
+				l.cdev = cdev;
+				break;
+			}
+
+			if (op == OP_CDEV_VALID && !cdev[0]) {
+				printf("\t%s: no vfio cdev, skipping\n",
+				       op_names[op]);
+				continue;
+			}
+
+			for (t = 1; ; t *= 2) {
+				if (t > max_threads)
+					t = max_threads;
+				run(&l, t);
+				if (t == max_threads)
+					break;
+			}
+		}
+
+		close(device);
+		close(group);
+		close(container);
+	}
+
+	return 0;
+}
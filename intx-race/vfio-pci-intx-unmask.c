@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "../utils.h"
+
+#define DEFAULT_ITERATIONS 100000
+
+void usage(char *name)
+{
+	printf("usage: %s [-n iterations] ssss:bb:dd.f\n", name);
+	printf("\t-n:   cycles per unmask method, default %d\n",
+	       DEFAULT_ITERATIONS);
+}
+
+/*
+ * Each cycle the trigger thread fires INTx with a software trigger and the
+ * consumer reads the eventfd and unmasks, then the next cycle starts.
+ * Software triggers don't mask INTx the way the hardware handler does, so
+ * the irqfd and ioctl methods measure the cost of the unmask path itself,
+ * the mask method masks through SET_IRQS before each trigger for a full
+ * mask/unmask cycle.
+ */
+enum method { METHOD_IRQFD, METHOD_IOCTL, METHOD_MASK, NR_METHODS };
+
+static const char *method_names[] = { "irqfd unmask", "ioctl unmask",
+				      "mask/unmask" };
+
+struct cycle {
+	int device;
+	int intx;
+	int unmask;
+	enum method method;
+	unsigned long iterations;
+	unsigned long stamp;
+	unsigned long seq;
+	struct lat_stats consume;
+	struct lat_stats unmask_lat;
+};
+
+static int intx_action(int device, uint32_t action)
+{
+	struct vfio_irq_set irq_set = {
+		.argsz = sizeof(irq_set),
+		.flags = VFIO_IRQ_SET_DATA_NONE | action,
+		.index = VFIO_PCI_INTX_IRQ_INDEX,
+		.start = 0,
+		.count = 1,
+	};
+
+	return ioctl(device, VFIO_DEVICE_SET_IRQS, &irq_set);
+}
+
+static void *consumer_func(void *arg)
+{
+	struct cycle *c = arg;
+	unsigned long i, before;
+	uint64_t buf = 1;
+
+	for (i = 0; i < c->iterations; i++) {
+		if (read(c->intx, &buf, sizeof(buf)) != sizeof(buf)) {
+			printf("INTx read (%m)\n");
+			break;
+		}
+
+		before = now_nsec();
+		lat_stats_add(&c->consume,
+			      before - __atomic_load_n(&c->stamp,
+						       __ATOMIC_ACQUIRE));
+
+		if (c->method == METHOD_IRQFD) {
+			buf = 1;
+			if (write(c->unmask, &buf, sizeof(buf)) != sizeof(buf))
+				printf("unmask irqfd (%m)\n");
+		} else if (intx_action(c->device, VFIO_IRQ_SET_ACTION_UNMASK)) {
+			printf("INTx unmask (%m)\n");
+		}
+
+		lat_stats_add(&c->unmask_lat, now_nsec() - before);
+		__atomic_store_n(&c->seq, i + 1, __ATOMIC_RELEASE);
+	}
+
+	/* Don't leave the trigger thread waiting */
+	__atomic_store_n(&c->seq, c->iterations, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int run(int device, enum method method, unsigned long iterations)
+{
+	struct cycle c = {
+		.device = device,
+		.method = method,
+		.iterations = iterations,
+	};
+	struct lat_stats trigger, mask;
+	unsigned long i, start, before, nsecs;
+	pthread_t consumer;
+	int32_t fd;
+	int ret;
+
+	c.intx = eventfd(0, EFD_CLOEXEC);
+	c.unmask = eventfd(0, EFD_CLOEXEC);
+	if (c.intx < 0 || c.unmask < 0) {
+		printf("Failed to get eventfds\n");
+		return -1;
+	}
+
+	fd = c.intx;
+	ret = vfio_irq_set_eventfds(device, VFIO_PCI_INTX_IRQ_INDEX, 0, 1, &fd);
+	if (ret) {
+		printf("INTx enable (%s)\n", strerror(-ret));
+		goto out_close;
+	}
+
+	if (method == METHOD_IRQFD) {
+		struct {
+			struct vfio_irq_set set;
+			int32_t fd;
+		} irq_set = {
+			.set = {
+				.argsz = sizeof(irq_set),
+				.flags = VFIO_IRQ_SET_DATA_EVENTFD |
+					 VFIO_IRQ_SET_ACTION_UNMASK,
+				.index = VFIO_PCI_INTX_IRQ_INDEX,
+				.start = 0,
+				.count = 1,
+			},
+			.fd = c.unmask,
+		};
+
+		ret = ioctl(device, VFIO_DEVICE_SET_IRQS, &irq_set);
+		if (ret) {
+			printf("unmask irqfd setup (%m)\n");
+			goto out_disable;
+		}
+	}
+
+	lat_stats_init(&trigger, iterations);
+	lat_stats_init(&mask, method == METHOD_MASK ? iterations : 0);
+	lat_stats_init(&c.consume, iterations);
+	lat_stats_init(&c.unmask_lat, iterations);
+
+	if (pthread_create(&consumer, NULL, consumer_func, &c)) {
+		printf("Failed to create consumer thread\n");
+		ret = -1;
+		goto out_free;
+	}
+
+	start = now_nsec();
+
+	for (i = 0; i < iterations; i++) {
+		if (method == METHOD_MASK) {
+			before = now_nsec();
+			if (intx_action(device, VFIO_IRQ_SET_ACTION_MASK))
+				printf("INTx mask (%m)\n");
+			lat_stats_add(&mask, now_nsec() - before);
+		}
+
+		before = now_nsec();
+		__atomic_store_n(&c.stamp, before, __ATOMIC_RELEASE);
+		if (intx_action(device, VFIO_IRQ_SET_ACTION_TRIGGER)) {
+			printf("INTx trigger (%m)\n");
+			pthread_cancel(consumer);
+			ret = -1;
+			break;
+		}
+		lat_stats_add(&trigger, now_nsec() - before);
+
+		while (__atomic_load_n(&c.seq, __ATOMIC_ACQUIRE) < i + 1)
+			;
+	}
+
+	nsecs = now_nsec() - start;
+	pthread_join(consumer, NULL);
+
+	if (ret)
+		goto out_free;
+
+	printf("%s: %.0f cycles/s\n", method_names[method],
+	       (double)iterations * NSEC_PER_SEC / nsecs);
+	if (method == METHOD_MASK)
+		lat_stats_print("mask", &mask);
+	lat_stats_print("trigger", &trigger);
+	lat_stats_print("trigger->consume", &c.consume);
+	lat_stats_print("unmask", &c.unmask_lat);
+	fflush(stdout);
+
+out_free:
+	lat_stats_free(&trigger);
+	lat_stats_free(&mask);
+	lat_stats_free(&c.consume);
+	lat_stats_free(&c.unmask_lat);
+out_disable:
+	vfio_irq_disable(device, VFIO_PCI_INTX_IRQ_INDEX);
+out_close:
+	close(c.intx);
+	close(c.unmask);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int container, device, opt;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	struct vfio_irq_info irq_info = {
+		.argsz = sizeof(irq_info),
+		.index = VFIO_PCI_INTX_IRQ_INDEX
+	};
+	enum method method;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !iterations) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (vfio_device_attach(argv[optind], &container, &device, NULL))
+		return -1;
+
+	if (ioctl(device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info)) {
+		printf("Failed to get IRQ info\n");
+		return -1;
+	}
+
+	if (irq_info.count != 1 || !(irq_info.flags & VFIO_IRQ_INFO_EVENTFD)) {
+		printf("Error, device does not support INTx\n");
+		return -1;
+	}
+
+	for (method = METHOD_IRQFD; method < NR_METHODS; method++)
+		run(device, method, iterations);
+
+	return 0;
+}
@@ -11,12 +11,23 @@ set -x
 ./vfio-huge-guest-test $groupid
 ./vfio-iommu-map-unmap $device
 ./vfio-iommu-stress-test $device
+./vfio-iommu-vma-fragmentation $device
 ./vfio-noiommu-pci-device-open $device
 ./vfio-pci-device-dma-map $device
+./vfio-pci-dma-logging $device
 ./vfio-pci-device-open $device
+./vfio-pci-device-open-churn $device
 ./vfio-pci-device-open-igd $device
 ./vfio-pci-device-open-sparse-mmap $device
 ./vfio-pci-hot-reset $device
+./vfio-pci-reset-latency $device
 ./vfio-pci-huge-fault-race $device
+./vfio-pci-bar-fault-latency $device
+./vfio-pci-bar-bandwidth $device
+./vfio-pci-region-access-latency $device
+./vfio-pci-irq-latency $device
+./vfio-pci-msix-setup $device
+./vfio-pci-irq-fanin $device
 ./iommufd-pci-device-open $device
 ./vfio-pci-device-migration $device
+./vfio-pci-migration-snapshot $device
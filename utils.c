@@ -19,14 +19,23 @@
 #include <limits.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <dirent.h>
 
+#include <linux/iommufd.h>
 #include <linux/vfio.h>
 
+#include "utils.h"
+
+#ifndef RUSAGE_THREAD
+#define RUSAGE_THREAD 1
+#endif
+
 int verbose;
 
-int vfio_device_iommufd_getfd(const char *devname)
+/* Find the /dev/vfio/devices/vfioX cdev for a PCI device */
+int vfio_device_cdev_path(const char *devname, char *cdev, size_t len)
 {
 	int  domain, bus, dev, func;
 	char path[PATH_MAX];
@@ -47,7 +56,7 @@ int vfio_device_iommufd_getfd(const char *devname)
 
 	dir = opendir(path);
 	if (!dir) {
-		printf("couldn't open directory %s", path);
+		printf("couldn't open directory %s\n", path);
 		return -1;
 	}
 
@@ -57,14 +66,27 @@ int vfio_device_iommufd_getfd(const char *devname)
 			break;
 		}
 	}
+
+	if (vfio_path)
+		snprintf(cdev, len, "/dev/vfio/devices/%s", vfio_path);
 	closedir(dir);
 
 	if (!vfio_path) {
-		printf("failed to find vfio-dev/vfioX");
+		printf("failed to find vfio-dev/vfioX\n");
 		return -1;
 	}
 
-	snprintf(path, sizeof(path), "/dev/vfio/devices/%s", vfio_path);
+	return 0;
+}
+
+int vfio_device_iommufd_getfd(const char *devname)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	if (vfio_device_cdev_path(devname, path, sizeof(path)))
+		return -1;
+
 	ret = open(path, O_RDWR);
 	if (ret < 0) {
 		printf("Failed to open %s, %d (%s)\n",
@@ -74,7 +96,77 @@ int vfio_device_iommufd_getfd(const char *devname)
 	return ret;
 }
 
-static int vfio_device_get_groupid(const char *devname)
+int iommufd_open(void)
+{
+	int fd;
+
+	fd = open("/dev/iommu", O_RDWR);
+	if (fd < 0) {
+		printf("Failed to open /dev/iommu : %d (%s)\n",
+		       fd, strerror(errno));
+	}
+	return fd;
+}
+
+/*
+ * Bind the device cdev to an already open iommufd and attach it to a new
+ * IOAS.  Taking the iommufd from the caller allows options such as
+ * IOMMU_OPTION_RLIMIT_MODE to be set before any objects exist.
+ */
+int vfio_device_iommufd_attach(const char *devname, int iommufd,
+			       int *device_out, unsigned int *ioas_out)
+{
+	struct vfio_device_bind_iommufd bind = {
+		.argsz = sizeof(bind),
+		.iommufd = iommufd,
+	};
+	struct iommu_ioas_alloc alloc = { .size = sizeof(alloc) };
+	struct vfio_device_attach_iommufd_pt attach = {
+		.argsz = sizeof(attach),
+	};
+	int device, ret;
+
+	device = vfio_device_iommufd_getfd(devname);
+	if (device < 0)
+		return -1;
+
+	ret = ioctl(device, VFIO_DEVICE_BIND_IOMMUFD, &bind);
+	if (ret) {
+		printf("Failed VFIO_DEVICE_BIND_IOMMUFD %d (%s)\n",
+		       ret, strerror(errno));
+		goto out_close;
+	}
+
+	ret = ioctl(iommufd, IOMMU_IOAS_ALLOC, &alloc);
+	if (ret) {
+		printf("Failed IOMMU_IOAS_ALLOC %d (%s)\n",
+		       ret, strerror(errno));
+		goto out_close;
+	}
+
+	attach.pt_id = alloc.out_ioas_id;
+	ret = ioctl(device, VFIO_DEVICE_ATTACH_IOMMUFD_PT, &attach);
+	if (ret) {
+		printf("Failed VFIO_DEVICE_ATTACH_IOMMUFD_PT ioas_id %d %d (%s)\n",
+		       alloc.out_ioas_id, ret, strerror(errno));
+		goto out_close;
+	}
+
+	if (device_out)
+		*device_out = device;
+	else
+		close(device);
+	if (ioas_out)
+		*ioas_out = alloc.out_ioas_id;
+	return 0;
+
+out_close:
+	close(device);
+	return -1;
+}
+
+/* PCI devices are named ssss:bb:dd.f, anything else is taken as an mdev UUID */
+int vfio_device_get_groupid(const char *devname)
 {
 	int  domain, bus, dev, func;
 	char group_path[PATH_MAX];
@@ -82,20 +174,26 @@ static int vfio_device_get_groupid(const char *devname)
 	char *group_name = NULL;
 	int ret, groupid;
 	ssize_t len;
+	bool pci;
 
 	ret = sscanf(devname, "%04x:%02x:%02x.%d", &domain, &bus, &dev, &func);
-	if (ret != 4) {
-		printf("Invalid PCI device identifier \"%s\"\n", devname);
-		return -1;
-	}
+	pci = ret == 4;
 
-	snprintf(tmp, sizeof(tmp),
-		 "/sys/bus/pci/devices/%04x:%02x:%02x.%01x/iommu_group",
-		 domain, bus, dev, func);
+	if (pci)
+		snprintf(tmp, sizeof(tmp),
+			 "/sys/bus/pci/devices/%04x:%02x:%02x.%01x/iommu_group",
+			 domain, bus, dev, func);
+	else
+		snprintf(tmp, sizeof(tmp),
+			 "/sys/bus/mdev/devices/%s/iommu_group", devname);
 
 	len = readlink(tmp, group_path, sizeof(group_path));
 	if (len <= 0 || len >= sizeof(group_path)) {
-		printf("%s: no iommu_group found\n", devname);
+		if (pci)
+			printf("%s: no iommu_group found\n", devname);
+		else
+			printf("Invalid PCI device or mdev identifier \"%s\"\n",
+			       devname);
 		return -1;
 	}
 
@@ -107,8 +205,11 @@ static int vfio_device_get_groupid(const char *devname)
 		return -1;
 	}
 
-	printf("Using device %04x:%02x:%02x.%d in IOMMU group %d\n",
-               domain, bus, dev, func, groupid);
+	if (pci)
+		printf("Using device %04x:%02x:%02x.%d in IOMMU group %d\n",
+		       domain, bus, dev, func, groupid);
+	else
+		printf("Using mdev %s in IOMMU group %d\n", devname, groupid);
 	return groupid;
 }
 
@@ -297,6 +398,330 @@ int vfio_device_attach_iommu_type(const char *devname, int *container_out,
 
 #define ALIGN_UP(x, a)  (((x) + (a) - 1) & ~((a) - 1))
 
+/*
+ * Walk a capability chain starting at cap_offset within info, returning the
+ * first capability with the given id.  Offsets are validated against argsz
+ * and must increase, so a malformed chain terminates.
+ */
+struct vfio_info_cap_header *vfio_info_cap_find(void *info, uint32_t argsz,
+						uint32_t cap_offset,
+						uint16_t id)
+{
+	struct vfio_info_cap_header *header;
+	uint32_t offset = cap_offset, prev = 0;
+
+	while (offset && offset > prev &&
+	       offset + sizeof(*header) <= argsz) {
+		header = info + offset;
+		if (header->id == id)
+			return header;
+
+		prev = offset;
+		offset = header->next;
+	}
+
+	return NULL;
+}
+
+static int vfio_region_get(int device, unsigned int index,
+			   struct vfio_region *region)
+{
+	struct vfio_region_info *info;
+	uint32_t argsz = sizeof(*info);
+
+	/* The chain size is only known after a first query, retry if it grows */
+	do {
+		info = calloc(1, argsz);
+		if (!info)
+			return -ENOMEM;
+
+		info->argsz = argsz;
+		info->index = index;
+
+		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, info)) {
+			int ret = -errno;
+
+			free(info);
+			return ret;
+		}
+
+		if (info->argsz <= argsz)
+			break;
+
+		argsz = info->argsz;
+		free(info);
+	} while (1);
+
+	region->info = info;
+
+	if (!(info->flags & VFIO_REGION_INFO_FLAG_CAPS))
+		return 0;
+
+#define REGION_CAP(id) \
+	(void *)vfio_info_cap_find(info, argsz, info->cap_offset, id)
+
+	region->sparse = REGION_CAP(VFIO_REGION_INFO_CAP_SPARSE_MMAP);
+	region->type = REGION_CAP(VFIO_REGION_INFO_CAP_TYPE);
+	region->nvlink2_ssatgt = REGION_CAP(VFIO_REGION_INFO_CAP_NVLINK2_SSATGT);
+	region->nvlink2_lnkspd = REGION_CAP(VFIO_REGION_INFO_CAP_NVLINK2_LNKSPD);
+	region->msix_mappable = !!REGION_CAP(VFIO_REGION_INFO_CAP_MSIX_MAPPABLE);
+
+#undef REGION_CAP
+
+	/* Don't trust nr_areas beyond what the kernel filled in */
+	if (region->sparse &&
+	    (void *)&region->sparse->areas[region->sparse->nr_areas] >
+	    (void *)info + argsz)
+		region->sparse = NULL;
+
+	return 0;
+}
+
+int vfio_regions_get(int device, struct vfio_regions *regions)
+{
+	struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
+	unsigned int i;
+	int ret;
+
+	memset(regions, 0, sizeof(*regions));
+
+	if (ioctl(device, VFIO_DEVICE_GET_INFO, &device_info)) {
+		printf("VFIO_DEVICE_GET_INFO failed: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	regions->regions = calloc(device_info.num_regions,
+				  sizeof(*regions->regions));
+	if (!regions->regions)
+		return -ENOMEM;
+
+	regions->nr = device_info.num_regions;
+
+	for (i = 0; i < regions->nr; i++) {
+		ret = vfio_region_get(device, i, &regions->regions[i]);
+		if (ret == -ENOMEM) {
+			vfio_regions_free(regions);
+			return ret;
+		}
+
+		/* Unimplemented indexes are expected, eg. VGA */
+		if (ret && verbose)
+			printf("Region %u: VFIO_DEVICE_GET_REGION_INFO failed: %s\n",
+			       i, strerror(-ret));
+	}
+
+	return 0;
+}
+
+void vfio_regions_free(struct vfio_regions *regions)
+{
+	unsigned int i;
+
+	for (i = 0; i < regions->nr; i++)
+		free(regions->regions[i].info);
+
+	free(regions->regions);
+	memset(regions, 0, sizeof(*regions));
+}
+
+struct vfio_region *vfio_region_find_type(struct vfio_regions *regions,
+					  uint32_t type, uint32_t subtype)
+{
+	unsigned int i;
+
+	for (i = 0; i < regions->nr; i++) {
+		struct vfio_region *region = vfio_region(regions, i);
+
+		if (region && region->type && region->type->type == type &&
+		    region->type->subtype == subtype)
+			return region;
+	}
+
+	return NULL;
+}
+
+struct vfio_pci_hot_reset_info *vfio_pci_hot_reset_info(int device)
+{
+	struct vfio_pci_hot_reset_info *info, *tmp;
+	size_t argsz = sizeof(*info);
+	int err;
+
+	info = calloc(1, argsz);
+	if (!info)
+		return NULL;
+
+	info->argsz = argsz;
+
+	if (!ioctl(device, VFIO_DEVICE_GET_PCI_HOT_RESET_INFO, info))
+		return info;
+
+	if (errno != ENOSPC) {
+		if (errno != ENODEV)
+			printf("VFIO_DEVICE_GET_PCI_HOT_RESET_INFO failed: %s\n",
+			       strerror(errno));
+		goto out_free;
+	}
+
+	argsz += info->count * sizeof(info->devices[0]);
+	tmp = realloc(info, argsz);
+	if (!tmp)
+		goto out_free;
+
+	info = tmp;
+	info->argsz = argsz;
+
+	if (ioctl(device, VFIO_DEVICE_GET_PCI_HOT_RESET_INFO, info)) {
+		printf("VFIO_DEVICE_GET_PCI_HOT_RESET_INFO failed: %s\n",
+		       strerror(errno));
+		goto out_free;
+	}
+
+	return info;
+
+out_free:
+	err = errno;
+	free(info);
+	errno = err;
+	return NULL;
+}
+
+int vfio_mig_set_state(int device, uint32_t state, int *data_fd)
+{
+	uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_device_feature) +
+				  sizeof(struct vfio_device_feature_mig_state),
+				  sizeof(uint64_t))] = {};
+	struct vfio_device_feature *feature = (struct vfio_device_feature *)buf;
+	struct vfio_device_feature_mig_state *mig =
+		(struct vfio_device_feature_mig_state *)feature->data;
+
+	feature->argsz = sizeof(buf);
+	feature->flags = VFIO_DEVICE_FEATURE_SET |
+			 VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE;
+	mig->device_state = state;
+	mig->data_fd = -1;
+
+	if (ioctl(device, VFIO_DEVICE_FEATURE, feature))
+		return -errno;
+
+	if (data_fd)
+		*data_fd = mig->data_fd;
+	else if (mig->data_fd >= 0)
+		close(mig->data_fd);
+
+	return 0;
+}
+
+int vfio_mig_get_state(int device, uint32_t *state)
+{
+	uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_device_feature) +
+				  sizeof(struct vfio_device_feature_mig_state),
+				  sizeof(uint64_t))] = {};
+	struct vfio_device_feature *feature = (struct vfio_device_feature *)buf;
+	struct vfio_device_feature_mig_state *mig =
+		(struct vfio_device_feature_mig_state *)feature->data;
+
+	feature->argsz = sizeof(buf);
+	feature->flags = VFIO_DEVICE_FEATURE_GET |
+			 VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE;
+
+	if (ioctl(device, VFIO_DEVICE_FEATURE, feature))
+		return -errno;
+
+	*state = mig->device_state;
+	return 0;
+}
+
+/* Estimated STOP_COPY stream length from the current state */
+int vfio_mig_data_size(int device, uint64_t *stop_copy_length)
+{
+	uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_device_feature) +
+				  sizeof(struct vfio_device_feature_mig_data_size),
+				  sizeof(uint64_t))] = {};
+	struct vfio_device_feature *feature = (struct vfio_device_feature *)buf;
+	struct vfio_device_feature_mig_data_size *size =
+		(struct vfio_device_feature_mig_data_size *)feature->data;
+
+	feature->argsz = sizeof(buf);
+	feature->flags = VFIO_DEVICE_FEATURE_GET |
+			 VFIO_DEVICE_FEATURE_MIG_DATA_SIZE;
+
+	if (ioctl(device, VFIO_DEVICE_FEATURE, feature))
+		return -errno;
+
+	*stop_copy_length = size->stop_copy_length;
+	return 0;
+}
+
+const char *vfio_mig_state_name(uint32_t state)
+{
+	static const char *names[] = {
+		[VFIO_DEVICE_STATE_ERROR] = "ERROR",
+		[VFIO_DEVICE_STATE_STOP] = "STOP",
+		[VFIO_DEVICE_STATE_RUNNING] = "RUNNING",
+		[VFIO_DEVICE_STATE_STOP_COPY] = "STOP_COPY",
+		[VFIO_DEVICE_STATE_RESUMING] = "RESUMING",
+		[VFIO_DEVICE_STATE_RUNNING_P2P] = "RUNNING_P2P",
+		[VFIO_DEVICE_STATE_PRE_COPY] = "PRE_COPY",
+		[VFIO_DEVICE_STATE_PRE_COPY_P2P] = "PRE_COPY_P2P",
+	};
+
+	if (state >= sizeof(names) / sizeof(names[0]) || !names[state])
+		return "UNKNOWN";
+
+	return names[state];
+}
+
+int vfio_irq_set_eventfds(int device, unsigned int index, unsigned int start,
+			  unsigned int count, int32_t *fds)
+{
+	struct vfio_irq_set *irq_set;
+	size_t argsz = sizeof(*irq_set) + count * sizeof(*fds);
+	int ret = 0;
+
+	irq_set = malloc(argsz);
+	if (!irq_set)
+		return -ENOMEM;
+
+	irq_set->argsz = argsz;
+	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
+	irq_set->index = index;
+	irq_set->start = start;
+	irq_set->count = count;
+	memcpy(&irq_set->data, fds, count * sizeof(*fds));
+
+	if (ioctl(device, VFIO_DEVICE_SET_IRQS, irq_set))
+		ret = -errno;
+
+	free(irq_set);
+	return ret;
+}
+
+int vfio_irq_disable(int device, unsigned int index)
+{
+	struct vfio_irq_set irq_set = {
+		.argsz = sizeof(irq_set),
+		.flags = VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER,
+		.index = index,
+	};
+
+	return ioctl(device, VFIO_DEVICE_SET_IRQS, &irq_set) ? -errno : 0;
+}
+
+/* Software trigger, signals the eventfds as if the device interrupted */
+int vfio_irq_trigger(int device, unsigned int index, unsigned int start,
+		     unsigned int count)
+{
+	struct vfio_irq_set irq_set = {
+		.argsz = sizeof(irq_set),
+		.flags = VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER,
+		.index = index,
+		.start = start,
+		.count = count,
+	};
+
+	return ioctl(device, VFIO_DEVICE_SET_IRQS, &irq_set) ? -errno : 0;
+}
+
 void *mmap_align(void *addr, size_t length, int prot, int flags,
 		 int fd, off_t offset, size_t align)
 {
@@ -319,3 +744,200 @@ void *mmap_align(void *addr, size_t length, int prot, int flags,
 		madvise(map, length, MADV_HUGEPAGE);
 	return map;
 }
+
+/*
+ * Sum AnonHugePages over the VMAs in /proc/self/smaps overlapping
+ * [start, end), optionally counting those VMAs.  Returns bytes or -1.
+ */
+long smaps_anon_huge(unsigned long start, unsigned long end,
+		     unsigned long *nr_vmas)
+{
+	unsigned long vm_start, vm_end, kb;
+	bool match = false;
+	char line[256];
+	long bytes = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (!fp) {
+		printf("Failed to open /proc/self/smaps (%s)\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	if (nr_vmas)
+		*nr_vmas = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lx-%lx ", &vm_start, &vm_end) == 2) {
+			match = vm_start < end && vm_end > start;
+			if (match && nr_vmas)
+				(*nr_vmas)++;
+			continue;
+		}
+
+		if (match && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+			bytes += kb * 1024;
+	}
+
+	fclose(fp);
+	return bytes;
+}
+
+int pagemap_open(void)
+{
+	int fd;
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		printf("Failed to open /proc/self/pagemap : %d (%s)\n",
+		       fd, strerror(errno));
+	}
+	return fd;
+}
+
+/*
+ * PFN backing vaddr, 0 if not present.  PFNs read as 0 without
+ * CAP_SYS_ADMIN.
+ */
+unsigned long pagemap_pfn(int fd, unsigned long vaddr)
+{
+	uint64_t ent;
+	off_t off = vaddr / getpagesize() * sizeof(ent);
+
+	if (pread(fd, &ent, sizeof(ent), off) != sizeof(ent))
+		return 0;
+
+	if (!(ent & (1ull << 63)))
+		return 0;
+
+	return ent & ((1ull << 55) - 1);
+}
+
+/* Minor faults taken by the calling thread, including those from GUP */
+unsigned long thread_minflt(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru))
+		return 0;
+
+	return ru.ru_minflt;
+}
+
+/* Read one word every stride bytes, returns the number of faults taken */
+unsigned long mmap_touch(void *map, size_t size, size_t stride)
+{
+	unsigned long before = thread_minflt();
+	size_t off;
+
+	for (off = 0; off < size; off += stride)
+		(void)*(volatile unsigned long *)(map + off);
+
+	return thread_minflt() - before;
+}
+
+/*
+ * Probe the size of the page table entries the kernel installs when
+ * faulting an unpopulated mapping, eg. huge pfnmap support for device
+ * BARs.  After faulting the first page, touch the last page of each
+ * larger naturally aligned block, no new fault means the first fault
+ * already covered it.  The mapping must be aligned to the largest size
+ * of interest, see mmap_align().
+ */
+size_t mmap_fault_size(void *map, size_t size)
+{
+	static const size_t sizes[] = { 2ul << 20, 1ul << 30 };
+	size_t pagesize = getpagesize(), fault_size = pagesize;
+	int i;
+
+	mmap_touch(map, pagesize, pagesize);
+
+	for (i = 0; i < 2 && sizes[i] <= size; i++) {
+		if (mmap_touch(map + sizes[i] - pagesize, pagesize, pagesize))
+			break;
+		fault_size = sizes[i];
+	}
+
+	return fault_size;
+}
+
+int lat_stats_init(struct lat_stats *stats, unsigned long hint)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	stats->alloc = hint ? hint : 1024;
+	stats->samples = malloc(stats->alloc * sizeof(*stats->samples));
+	if (!stats->samples) {
+		printf("Failed to allocate %lu latency samples\n", stats->alloc);
+		stats->alloc = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void lat_stats_free(struct lat_stats *stats)
+{
+	free(stats->samples);
+	memset(stats, 0, sizeof(*stats));
+}
+
+int __lat_stats_grow(struct lat_stats *stats)
+{
+	unsigned long alloc = stats->alloc ? stats->alloc * 2 : 1024;
+	unsigned long *samples;
+
+	samples = realloc(stats->samples, alloc * sizeof(*samples));
+	if (!samples)
+		return -1;
+
+	stats->samples = samples;
+	stats->alloc = alloc;
+	return 0;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile, pct in [0, 100] */
+unsigned long lat_stats_pct(struct lat_stats *stats, double pct)
+{
+	unsigned long idx;
+
+	if (!stats->count)
+		return 0;
+
+	if (!stats->sorted) {
+		qsort(stats->samples, stats->count,
+		      sizeof(*stats->samples), lat_cmp);
+		stats->sorted = true;
+	}
+
+	idx = (unsigned long)(pct / 100 * stats->count);
+	if (idx >= stats->count)
+		idx = stats->count - 1;
+
+	return stats->samples[idx];
+}
+
+void lat_stats_print(const char *name, struct lat_stats *stats)
+{
+	if (!stats->count) {
+		printf("\t%-20s no samples\n", name);
+		return;
+	}
+
+	printf("\t%-20s n %-9lu avg %9.3fus p50 %9.3fus p99 %9.3fus "
+	       "p99.9 %9.3fus max %9.3fus\n", name, stats->count,
+	       lat_stats_avg(stats) / 1000.0,
+	       lat_stats_pct(stats, 50) / 1000.0,
+	       lat_stats_pct(stats, 99) / 1000.0,
+	       lat_stats_pct(stats, 99.9) / 1000.0,
+	       lat_stats_pct(stats, 100) / 1000.0);
+}
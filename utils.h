@@ -10,20 +10,101 @@
 #ifndef VFIO_TESTSUITE_UTILS_H
 #define VFIO_TESTSUITE_UTILS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
+#include <linux/vfio.h>
+
 /*
  * Logging
  */
 extern int verbose;
 
+int vfio_device_get_groupid(const char *devname);
 int vfio_group_attach(int groupid, int *container_out, int *group_out);
 int vfio_device_attach(const char *devname, int *container_out,
 		       int *device_out, int *group_out);
 int vfio_device_attach_iommu_type(const char *devname, int *container_out,
 				  int *device_out, int *group_out,
 				  int iommu_type);
+int vfio_device_cdev_path(const char *devname, char *cdev, size_t len);
 int vfio_device_iommufd_getfd(const char *devname);
+int iommufd_open(void);
+int vfio_device_iommufd_attach(const char *devname, int iommufd,
+			       int *device_out, unsigned int *ioas_out);
+
+/*
+ * Region info cache, each region's info and full capability chain are
+ * fetched once per device.  Capability pointers reference the cached info
+ * and are NULL if the region doesn't report them, info is NULL if the
+ * region couldn't be queried.
+ */
+struct vfio_region {
+	struct vfio_region_info *info;
+	struct vfio_region_info_cap_sparse_mmap *sparse;
+	struct vfio_region_info_cap_type *type;
+	struct vfio_region_info_cap_nvlink2_ssatgt *nvlink2_ssatgt;
+	struct vfio_region_info_cap_nvlink2_lnkspd *nvlink2_lnkspd;
+	bool msix_mappable;
+};
+
+struct vfio_regions {
+	unsigned int nr;
+	struct vfio_region *regions;
+};
+
+int vfio_regions_get(int device, struct vfio_regions *regions);
+void vfio_regions_free(struct vfio_regions *regions);
+struct vfio_info_cap_header *vfio_info_cap_find(void *info, uint32_t argsz,
+						uint32_t cap_offset,
+						uint16_t id);
+struct vfio_region *vfio_region_find_type(struct vfio_regions *regions,
+					  uint32_t type, uint32_t subtype);
+
+static inline struct vfio_region *vfio_region(struct vfio_regions *regions,
+					      unsigned int index)
+{
+	if (index >= regions->nr || !regions->regions[index].info)
+		return NULL;
+
+	return &regions->regions[index];
+}
+
+static inline bool vfio_region_mmappable(struct vfio_region *region)
+{
+	return region->info->flags & VFIO_REGION_INFO_FLAG_MMAP;
+}
+
+static inline unsigned int vfio_region_nr_areas(struct vfio_region *region)
+{
+	return region->sparse ? region->sparse->nr_areas : 0;
+}
+
+/*
+ * PCI hot reset, returns the dependent device info, freed by the caller, or
+ * NULL with errno ENODEV if the device doesn't support hot reset
+ */
+struct vfio_pci_hot_reset_info *vfio_pci_hot_reset_info(int device);
+
+/*
+ * Migration, set_state returns the data_fd for states with a data stream,
+ * -1 otherwise, all return 0 or -errno
+ */
+int vfio_mig_set_state(int device, uint32_t state, int *data_fd);
+int vfio_mig_get_state(int device, uint32_t *state);
+int vfio_mig_data_size(int device, uint64_t *stop_copy_length);
+const char *vfio_mig_state_name(uint32_t state);
+
+/*
+ * Interrupts, fds are eventfds for vectors start to start + count - 1
+ */
+int vfio_irq_set_eventfds(int device, unsigned int index, unsigned int start,
+			  unsigned int count, int32_t *fds);
+int vfio_irq_disable(int device, unsigned int index);
+int vfio_irq_trigger(int device, unsigned int index, unsigned int start,
+		     unsigned int count);
 
 #define NSEC_PER_SEC 1000000000ul
 #define USEC_PER_SEC 1000000ul
@@ -40,4 +121,47 @@ void *mmap_align(void *addr, size_t length, int prot, int flags,
 
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
+/*
+ * Memory introspection
+ */
+long smaps_anon_huge(unsigned long start, unsigned long end,
+		     unsigned long *nr_vmas);
+int pagemap_open(void);
+unsigned long pagemap_pfn(int fd, unsigned long vaddr);
+unsigned long thread_minflt(void);
+unsigned long mmap_touch(void *map, size_t size, size_t stride);
+size_t mmap_fault_size(void *map, size_t size);
+
+/*
+ * Latency statistics, samples in nanoseconds
+ */
+struct lat_stats {
+	unsigned long *samples;
+	unsigned long count;
+	unsigned long alloc;
+	unsigned long total;
+	bool sorted;
+};
+
+int lat_stats_init(struct lat_stats *stats, unsigned long hint);
+void lat_stats_free(struct lat_stats *stats);
+int __lat_stats_grow(struct lat_stats *stats);
+unsigned long lat_stats_pct(struct lat_stats *stats, double pct);
+void lat_stats_print(const char *name, struct lat_stats *stats);
+
+static inline void lat_stats_add(struct lat_stats *stats, unsigned long nsec)
+{
+	if (stats->count == stats->alloc && __lat_stats_grow(stats))
+		return;
+
+	stats->samples[stats->count++] = nsec;
+	stats->total += nsec;
+	stats->sorted = false;
+}
+
+static inline unsigned long lat_stats_avg(struct lat_stats *stats)
+{
+	return stats->count ? stats->total / stats->count : 0;
+}
+
 #endif /* VFIO_TESTSUITE_UTILS_H */
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <libgen.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,42 +19,315 @@
 #define MAP_SIZE (1UL * 1024 * 1024 * 1024)
 #define MAP_CHUNK (4 * 1024)
 #define REALLOC_INTERVAL 30
+#define PREMAP_ROUNDS 10
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+struct round_stats {
+	unsigned long vmas;
+	long thp_bytes;
+	unsigned long extents;
+	unsigned long extents_2m;
+};
+
+/*
+ * Walk the chunks in IOVA order and count physically contiguous extents,
+ * ie. the minimum number of IOMMU mappings the range could be built from,
+ * and how many 2MB IOVA blocks are backed by a naturally aligned 2MB
+ * physical range and could therefore use an IOMMU superpage.  Chunks are
+ * taken from maps[] if provided, otherwise they are contiguous from base.
+ * Returns -1 with both counts zeroed if the PFNs aren't available.
+ */
+static int count_extents(void **maps, void *base, unsigned long nr,
+			 size_t chunk, struct round_stats *stats)
+{
+	unsigned long per_2m = (2ul * 1024 * 1024) / chunk;
+	unsigned long i, pfn, prev = 0, run = 0;
+	int fd, ret = 0;
+
+	stats->extents = stats->extents_2m = 0;
+
+	fd = pagemap_open();
+	if (fd < 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		pfn = pagemap_pfn(fd, maps ? (unsigned long)maps[i] :
+				  (unsigned long)base + i * chunk);
+		if (!pfn) {
+			/* Not present or PFNs hidden without CAP_SYS_ADMIN */
+			stats->extents = stats->extents_2m = 0;
+			ret = -1;
+			break;
+		}
+
+		if (!i || pfn != prev + 1)
+			stats->extents++;
+
+		if (i % per_2m == 0)
+			run = pfn % per_2m == 0;
+		else if (run && pfn != prev + 1)
+			run = 0;
+
+		if (run && i % per_2m == per_2m - 1)
+			stats->extents_2m++;
+
+		prev = pfn;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/* Returns -1 if the extents couldn't be counted, thp_bytes < 0 on failure */
+static int collect_round_stats(void **maps, unsigned long nr, size_t chunk,
+				struct round_stats *stats)
+{
+	unsigned long i, lo = ~0ul, hi = 0;
+
+	for (i = 0; i < nr; i++) {
+		if ((unsigned long)maps[i] < lo)
+			lo = (unsigned long)maps[i];
+		if ((unsigned long)maps[i] > hi)
+			hi = (unsigned long)maps[i];
+	}
+
+	/* The chunks normally merge into a handful of VMAs in [lo, hi] */
+	stats->thp_bytes = smaps_anon_huge(lo, hi + chunk, &stats->vmas);
+	return count_extents(maps, NULL, nr, chunk, stats);
+}
+
+/*
+ * Pre-mapping comparison: build the same 1GB as a single aligned buffer,
+ * either relying on MADV_HUGEPAGE at fault time as mmap_align() sets up,
+ * or populating it with small pages and forcing a synchronous
+ * MADV_COLLAPSE before the DMA map, then compare setup cost, superpage eligibility and unmap.
+ */
+struct premap_result {
+	const char *name;
+	struct lat_stats setup;
+	struct lat_stats collapse;
+	struct lat_stats map;
+	struct lat_stats unmap;
+	unsigned long thp_bytes;
+	unsigned long extents_2m;
+};
+
+static int premap_round(int container, bool collapse,
+			struct premap_result *res, unsigned long count)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.size = MAP_SIZE,
+		.iova = 0,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.size = MAP_SIZE,
+		.iova = 0,
+	};
+	unsigned long start, before, collapse_nsecs = 0, map_nsecs, unmap_nsecs;
+	struct round_stats stats = { 0 };
+	int extents;
+	void *buf;
+
+	start = now_nsec();
+
+	buf = mmap_align(NULL, MAP_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0, 2ul * 1024 * 1024);
+	if (buf == MAP_FAILED) {
+		printf("Failed to mmap memory (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	if (collapse) {
+		before = now_nsec();
+
+		/*
+		 * MADV_COLLAPSE only collapses populated ranges, but with
+		 * the MADV_HUGEPAGE from mmap_align() populating would fault
+		 * in THPs directly and leave nothing to collapse.  Populate
+		 * with small pages, then restore the advice, which
+		 * MADV_COLLAPSE also needs as VM_NOHUGEPAGE refuses it.
+		 */
+		madvise(buf, MAP_SIZE, MADV_NOHUGEPAGE);
+		if (madvise(buf, MAP_SIZE, MADV_POPULATE_WRITE))
+			memset(buf, 0, MAP_SIZE);
+		madvise(buf, MAP_SIZE, MADV_HUGEPAGE);
+
+		if (madvise(buf, MAP_SIZE, MADV_COLLAPSE))
+			printf("MADV_COLLAPSE incomplete (%s)\n",
+			       strerror(errno));
+
+		collapse_nsecs = now_nsec() - before;
+		lat_stats_add(&res->collapse, collapse_nsecs);
+	}
+
+	dma_map.vaddr = (unsigned long)buf;
+
+	before = now_nsec();
+	if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+		printf("Failed to map memory (%s)\n", strerror(errno));
+		munmap(buf, MAP_SIZE);
+		return -1;
+	}
+	map_nsecs = now_nsec() - before;
+
+	lat_stats_add(&res->setup, now_nsec() - start);
+	lat_stats_add(&res->map, map_nsecs);
+
+	stats.thp_bytes = smaps_anon_huge((unsigned long)buf,
+					  (unsigned long)buf + MAP_SIZE, NULL);
+	extents = count_extents(NULL, buf, MAP_SIZE / MAP_CHUNK, MAP_CHUNK,
+				&stats);
+	if (stats.thp_bytes > 0)
+		res->thp_bytes += stats.thp_bytes;
+	res->extents_2m += stats.extents_2m;
+
+	before = now_nsec();
+	if (ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap)) {
+		printf("Failed to unmap memory (%s)\n", strerror(errno));
+		munmap(buf, MAP_SIZE);
+		return -1;
+	}
+	unmap_nsecs = now_nsec() - before;
+	lat_stats_add(&res->unmap, unmap_nsecs);
+
+	munmap(buf, MAP_SIZE);
+
+	printf("round %4lu %-9s: collapse %3lu.%03lus map %3lu.%03lus "
+	       "unmap %3lu.%03lus, ",
+	       count, res->name,
+	       collapse_nsecs / NSEC_PER_SEC,
+	       (collapse_nsecs % NSEC_PER_SEC) / USEC_PER_SEC,
+	       map_nsecs / NSEC_PER_SEC,
+	       (map_nsecs % NSEC_PER_SEC) / USEC_PER_SEC,
+	       unmap_nsecs / NSEC_PER_SEC,
+	       (unmap_nsecs % NSEC_PER_SEC) / USEC_PER_SEC);
+	if (stats.thp_bytes < 0)
+		printf("THP unavailable, ");
+	else
+		printf("THP %4ldMB, ", stats.thp_bytes >> 20);
+	if (extents)
+		printf("PFNs unavailable\n");
+	else
+		printf("%lu/%lu 2MB-eligible\n", stats.extents_2m,
+		       MAP_SIZE / (2ul * 1024 * 1024));
+	fflush(stdout);
+	return 0;
+}
+
+static int premap_compare(int container, unsigned long rounds)
+{
+	struct premap_result results[2] = {
+		{ .name = "hugepage" },
+		{ .name = "collapse" },
+	};
+	unsigned long count;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (lat_stats_init(&results[i].setup, rounds) ||
+		    lat_stats_init(&results[i].collapse, rounds) ||
+		    lat_stats_init(&results[i].map, rounds) ||
+		    lat_stats_init(&results[i].unmap, rounds))
+			return -1;
+	}
+
+	/* Alternate so both see similar memory fragmentation */
+	for (count = 0; count < rounds; count++) {
+		for (i = 0; i < 2; i++) {
+			if (premap_round(container, i, &results[i], count))
+				return -1;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		printf("%s: avg THP %luMB, avg %lu/%lu 2MB-eligible\n",
+		       results[i].name, results[i].thp_bytes / rounds >> 20,
+		       results[i].extents_2m / rounds,
+		       MAP_SIZE / (2ul * 1024 * 1024));
+		lat_stats_print("setup", &results[i].setup);
+		if (i)
+			lat_stats_print("collapse", &results[i].collapse);
+		lat_stats_print("map", &results[i].map);
+		lat_stats_print("unmap", &results[i].unmap);
+
+		lat_stats_free(&results[i].setup);
+		lat_stats_free(&results[i].collapse);
+		lat_stats_free(&results[i].map);
+		lat_stats_free(&results[i].unmap);
+	}
+
+	return 0;
+}
 
 void usage(char *name)
 {
-	printf("usage: %s ssss:bb:dd.f\n", name);
+	printf("usage: %s [-n rounds] [-p] ssss:bb:dd.f\n", name);
 	printf("\tssss: PCI segment, ex. 0000\n");
 	printf("\tbb:   PCI bus, ex. 01\n");
 	printf("\tdd:   PCI device, ex. 06\n");
 	printf("\tf:    PCI function, ex. 0\n");
+	printf("\t-n:   number of map/unmap rounds, default 0 (forever)\n");
+	printf("\t-p:   compare MADV_HUGEPAGE and MADV_COLLAPSE pre-mapping of a\n"
+	       "\t      single 1GB buffer instead, default %d rounds\n",
+	       PREMAP_ROUNDS);
 }
 
 int main(int argc, char **argv)
 {
 	const char *devname;
-	int ret, container;
-	unsigned long i, count;
+	int ret, container, opt, extents;
+	bool premap = false;
+	unsigned long i, count, rounds = 0;
+	unsigned long before, map_nsecs, unmap_nsecs;
+	struct round_stats stats = { 0 };
 	void **maps;
-	struct vfio_group_status group_status = {
-		.argsz = sizeof(group_status)
-	};
 	struct vfio_iommu_type1_dma_map dma_map = {
 		.argsz = sizeof(dma_map)
 	};
 	struct vfio_iommu_type1_dma_unmap dma_unmap = {
 		.argsz = sizeof(dma_unmap)
 	};
+	struct lat_stats unmap_lat;
 
-	if (argc != 2) {
+	while ((opt = getopt(argc, argv, "n:p")) != -1) {
+		switch (opt) {
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			premap = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return -1;
 	}
 
-	devname = argv[1];
+	devname = argv[optind];
 
 	if (vfio_device_attach(devname, &container, NULL, NULL))
 		return -1;
 
+	if (premap)
+		return premap_compare(container, rounds ? rounds : PREMAP_ROUNDS);
+
+	if (lat_stats_init(&unmap_lat, rounds))
+		return -1;
+
 	/* Test code */
 	dma_map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
 	dma_map.size = MAP_CHUNK;
@@ -69,7 +343,7 @@ int main(int argc, char **argv)
 
 	memset(maps, 0, sizeof(void *) * (MAP_SIZE/dma_map.size));
 
-	for (count = 0;; count++) {
+	for (count = 0; !rounds || count < rounds; count++) {
 
 		/* Every REALLOC_INTERVAL, dump our mappings to give THP something to collapse */
 		if (count % REALLOC_INTERVAL == 0) {
@@ -79,14 +353,11 @@ int main(int argc, char **argv)
 					maps[i] = NULL;
 				}
 			}
-			if (count) {
-				printf("\t%ld\n", count);
-				//return 0;
-			}
-			printf("|");
-			fflush(stdout);
+			printf("round %4lu: reallocating mmaps\n", count);
 		}
 
+		before = now_nsec();
+
 		/* Map MAP_CHUNK at a time, each chunk is pinned on map, so THP can't do anything until unmap */
 		for (i = dma_map.iova = 0; i < MAP_SIZE/dma_map.size; i++, dma_map.iova += dma_map.size) {
 			if (!maps[i]) {
@@ -114,19 +385,45 @@ int main(int argc, char **argv)
 			}
 		}
 
-		printf("+");
-		fflush(stdout);
+		map_nsecs = now_nsec() - before;
+
+		/* Sample while pinned, this is what the IOMMU was given */
+		extents = collect_round_stats(maps, MAP_SIZE/dma_map.size,
+					      dma_map.size, &stats);
 
 		/* Unmap everything at once */
+		before = now_nsec();
 		ret = ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
 		if (ret) {
 			printf("Failed to unmap memory (%s)\n", strerror(errno));
 			return ret;
 		}
+		unmap_nsecs = now_nsec() - before;
+		lat_stats_add(&unmap_lat, unmap_nsecs);
 
-		printf("-");
+		printf("round %4lu: map %3lu.%03lus unmap %3lu.%03lus, ",
+		       count, map_nsecs / NSEC_PER_SEC,
+		       (map_nsecs % NSEC_PER_SEC) / USEC_PER_SEC,
+		       unmap_nsecs / NSEC_PER_SEC,
+		       (unmap_nsecs % NSEC_PER_SEC) / USEC_PER_SEC);
+		if (stats.thp_bytes < 0)
+			printf("THP unavailable, ");
+		else
+			printf("THP %4ldMB (%5.1f%%) in %lu vmas, ",
+			       stats.thp_bytes >> 20,
+			       100.0 * stats.thp_bytes / MAP_SIZE, stats.vmas);
+		printf("%lu dma mappings, ", MAP_SIZE / MAP_CHUNK);
+		if (extents)
+			printf("PFNs unavailable\n");
+		else
+			printf("%lu phys extents, %lu 2MB-eligible\n",
+			       stats.extents, stats.extents_2m);
 		fflush(stdout);
 	}
 
+	printf("1GB unmap latency over %lu rounds:\n", count);
+	lat_stats_print("unmap", &unmap_lat);
+	lat_stats_free(&unmap_lat);
+
 	return 0;
 }
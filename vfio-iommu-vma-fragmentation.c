@@ -0,0 +1,229 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define MAP_SIZE (1UL * 1024 * 1024 * 1024)
+#define DEFAULT_ROUNDS 5
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+void usage(char *name)
+{
+	printf("usage: %s [-n rounds] <ssss:bb:dd.f>\n", name);
+	printf("\t-n:   rounds per configuration, default %d\n",
+	       DEFAULT_ROUNDS);
+}
+
+/*
+ * Build MAP_SIZE of anonymous memory from nr_pieces fixed mappings.  The
+ * pieces are adjacent and otherwise identical, so they merge into a single
+ * VMA unless separate is set, in which case every other piece is marked
+ * MADV_DONTDUMP.  That differing vm_flags bit keeps every piece its own VMA
+ * without affecting how the pages are pinned.
+ */
+static void *build_range(unsigned long nr_pieces, bool separate)
+{
+	size_t piece = MAP_SIZE / nr_pieces;
+	unsigned long i;
+	void *base, *map;
+
+	base = mmap(NULL, MAP_SIZE, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		printf("Failed to reserve range (%s)\n", strerror(errno));
+		return MAP_FAILED;
+	}
+
+	for (i = 0; i < nr_pieces; i++) {
+		map = mmap(base + i * piece, piece, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		if (map == MAP_FAILED) {
+			printf("Failed to mmap piece %lu (%s)%s\n", i,
+			       strerror(errno), errno == ENOMEM ?
+			       ", check vm.max_map_count" : "");
+			munmap(base, MAP_SIZE);
+			return MAP_FAILED;
+		}
+
+		if (separate && (i & 1))
+			madvise(map, piece, MADV_DONTDUMP);
+	}
+
+	/* Compare gup walk cost, not THP vs 4K or page fault cost */
+	madvise(base, MAP_SIZE, MADV_NOHUGEPAGE);
+	if (madvise(base, MAP_SIZE, MADV_POPULATE_WRITE))
+		memset(base, 0, MAP_SIZE);
+
+	return base;
+}
+
+static int unmap_all(int container)
+{
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.size = MAP_SIZE,
+		.iova = 0,
+	};
+
+	if (ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap)) {
+		printf("Failed to unmap memory (%s)\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int run_config(int container, unsigned long nr_pieces, bool separate,
+		      unsigned long rounds)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+	};
+	size_t piece = MAP_SIZE / nr_pieces;
+	struct lat_stats whole, per_piece;
+	unsigned long r, i, before, nsecs, vmas = 0, pin_nsecs = 0;
+	bool piece_ok = true;
+	void *base;
+	int ret = -1;
+
+	if (lat_stats_init(&whole, rounds) ||
+	    lat_stats_init(&per_piece, rounds * nr_pieces))
+		return -1;
+
+	for (r = 0; r < rounds; r++) {
+		base = build_range(nr_pieces, separate);
+		if (base == MAP_FAILED)
+			goto out;
+
+		if (!r)
+			smaps_anon_huge((unsigned long)base,
+					(unsigned long)base + MAP_SIZE, &vmas);
+
+		/* Pin the whole range with a single call */
+		dma_map.vaddr = (unsigned long)base;
+		dma_map.iova = 0;
+		dma_map.size = MAP_SIZE;
+
+		before = now_nsec();
+		if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+			printf("Failed to map memory (%s)\n", strerror(errno));
+			munmap(base, MAP_SIZE);
+			goto out;
+		}
+		nsecs = now_nsec() - before;
+		lat_stats_add(&whole, nsecs);
+		pin_nsecs += nsecs;
+
+		if (unmap_all(container)) {
+			munmap(base, MAP_SIZE);
+			goto out;
+		}
+
+		/* And again with one call per piece */
+		dma_map.size = piece;
+		for (i = 0; piece_ok && i < nr_pieces; i++) {
+			dma_map.vaddr = (unsigned long)base + i * piece;
+			dma_map.iova = i * piece;
+
+			before = now_nsec();
+			if (ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+				printf("Failed per-piece map %lu (%s)%s\n", i,
+				       strerror(errno), errno == ENOSPC ?
+				       ", check vfio_iommu_type1 dma_entry_limit" :
+				       "");
+				piece_ok = false;
+				break;
+			}
+			lat_stats_add(&per_piece, now_nsec() - before);
+		}
+
+		if (unmap_all(container)) {
+			munmap(base, MAP_SIZE);
+			goto out;
+		}
+
+		munmap(base, MAP_SIZE);
+	}
+
+	printf("%-8s pieces %6lu vmas %6lu: pin %6.2f GB/s\n",
+	       separate ? "separate" : "merged", nr_pieces, vmas,
+	       (double)MAP_SIZE * rounds / pin_nsecs);
+	lat_stats_print("single map", &whole);
+	if (piece_ok)
+		lat_stats_print("per-piece map", &per_piece);
+	fflush(stdout);
+	ret = 0;
+
+out:
+	lat_stats_free(&whole);
+	lat_stats_free(&per_piece);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	int container, opt, i, separate;
+	unsigned long rounds = DEFAULT_ROUNDS;
+	unsigned long pieces[] = { 1, 16, 1024, MAP_SIZE / 4096 };
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !rounds) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	devname = argv[optind];
+
+	if (vfio_device_attach(devname, &container, NULL, NULL))
+		return -1;
+
+	printf("Pinning %ldMB of prefaulted 4K pages, %lu rounds each\n",
+	       MAP_SIZE >> 20, rounds);
+
+	for (separate = 0; separate < 2; separate++) {
+		for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+			/* One piece is one VMA either way */
+			if (separate && pieces[i] == 1)
+				continue;
+
+			if (run_config(container, pieces[i], separate, rounds))
+				printf("Skipping %lu pieces\n", pieces[i]);
+		}
+	}
+
+	return 0;
+}
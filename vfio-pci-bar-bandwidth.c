@@ -0,0 +1,446 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "utils.h"
+
+#define DEFAULT_WINDOW (64ul * 1024 * 1024)
+#define DEFAULT_MSECS 200
+#define MAX_THREADS 64
+#define PATTERN 0x5a5a5a5a5a5a5a5aull
+
+void usage(char *name)
+{
+	printf("usage: %s [-w] [-t threads] [-s window MB] [-d msecs] "
+	       "<ssss:bb:dd.f | mdev uuid>\n", name);
+	printf("\t-w:   also run write and copy-to kernels, these overwrite\n"
+	       "\t      device memory, eg. an mbochs or mdpy framebuffer\n");
+	printf("\t-t:   max threads, sweeps 1, 2, 4..., default 1\n");
+	printf("\t-s:   bytes of each region to use, default %ldMB\n",
+	       DEFAULT_WINDOW >> 20);
+	printf("\t-d:   milliseconds per measurement, default %d\n",
+	       DEFAULT_MSECS);
+}
+
+/*
+ * Access kernels.  Each kernel is a load, store and OR for one access
+ * width, read ORs everything loaded into a sink so the loads can't be
+ * elided, write stores a pattern, copy does both between the BAR and a
+ * RAM buffer.  Non-temporal variants use streaming loads and stores.
+ */
+static uint64_t sink[8] __attribute__((aligned(64)));
+
+#define KERNELS(name, attr, type, load, store, or, set1, nt)		\
+static attr void name##_read(void *src, size_t len)			\
+{									\
+	type acc = set1(0), *p = src, *end = src + len;			\
+									\
+	while (p < end)							\
+		acc = or(acc, load(p++));				\
+	memcpy(sink, &acc, sizeof(acc));				\
+}									\
+									\
+static attr void name##_write(void *dst, size_t len)			\
+{									\
+	type val = set1(PATTERN), *p = dst, *end = dst + len;		\
+									\
+	while (p < end)							\
+		store(p++, val);					\
+	if (nt)								\
+		fence();						\
+}									\
+									\
+static attr void name##_copy(void *dst, void *src, size_t len)	\
+{									\
+	type *s = src, *d = dst, *end = dst + len;			\
+									\
+	while (d < end)							\
+		store(d++, load(s++));					\
+	if (nt)								\
+		fence();						\
+}
+
+static inline uint64_t u64_load(uint64_t *p)
+{
+	return *(volatile uint64_t *)p;
+}
+
+static inline void u64_store(uint64_t *p, uint64_t val)
+{
+	*(volatile uint64_t *)p = val;
+}
+
+static inline uint64_t u64_or(uint64_t a, uint64_t b)
+{
+	return a | b;
+}
+
+static inline uint64_t u64_set1(uint64_t val)
+{
+	return val;
+}
+
+#if defined(__x86_64__)
+#define fence() _mm_sfence()
+
+static inline void u64_stream(uint64_t *p, uint64_t val)
+{
+	_mm_stream_si64((long long *)p, val);
+}
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+#define AVX512 __attribute__((target("avx512f")))
+
+#define sse_load(p) _mm_load_si128(p)
+#define sse_load_nt(p) _mm_stream_load_si128(p)
+#define sse_store(p, v) _mm_store_si128(p, v)
+#define sse_store_nt(p, v) _mm_stream_si128(p, v)
+#define sse_set1(x) _mm_set1_epi64x(x)
+
+#define avx2_load(p) _mm256_load_si256(p)
+#define avx2_load_nt(p) _mm256_stream_load_si256(p)
+#define avx2_store(p, v) _mm256_store_si256(p, v)
+#define avx2_store_nt(p, v) _mm256_stream_si256(p, v)
+#define avx2_set1(x) _mm256_set1_epi64x(x)
+
+#define avx512_load(p) _mm512_load_si512(p)
+#define avx512_load_nt(p) _mm512_stream_load_si512(p)
+#define avx512_store(p, v) _mm512_store_si512(p, v)
+#define avx512_store_nt(p, v) _mm512_stream_si512(p, v)
+#define avx512_set1(x) _mm512_set1_epi64(x)
+
+KERNELS(u64, , uint64_t, u64_load, u64_store, u64_or, u64_set1, false)
+KERNELS(u64_nt, , uint64_t, u64_load, u64_stream, u64_or, u64_set1, true)
+KERNELS(sse, SSE41, __m128i, sse_load, sse_store, _mm_or_si128,
+	sse_set1, false)
+KERNELS(sse_nt, SSE41, __m128i, sse_load_nt, sse_store_nt, _mm_or_si128,
+	sse_set1, true)
+KERNELS(avx2, AVX2, __m256i, avx2_load, avx2_store, _mm256_or_si256,
+	avx2_set1, false)
+KERNELS(avx2_nt, AVX2, __m256i, avx2_load_nt, avx2_store_nt,
+	_mm256_or_si256, avx2_set1, true)
+KERNELS(avx512, AVX512, __m512i, avx512_load, avx512_store,
+	_mm512_or_si512, avx512_set1, false)
+KERNELS(avx512_nt, AVX512, __m512i, avx512_load_nt, avx512_store_nt,
+	_mm512_or_si512, avx512_set1, true)
+#else
+#define fence() do {} while (0)
+
+KERNELS(u64, , uint64_t, u64_load, u64_store, u64_or, u64_set1, false)
+#endif
+
+enum isa { ISA_BASE, ISA_SSE41, ISA_AVX2, ISA_AVX512 };
+
+struct kernel {
+	const char *name;
+	size_t width;
+	enum isa isa;
+	void (*read)(void *src, size_t len);
+	void (*write)(void *dst, size_t len);
+	void (*copy)(void *dst, void *src, size_t len);
+};
+
+#define KERNEL(n, w, i) { #n, w, i, n##_read, n##_write, n##_copy }
+
+static struct kernel kernels[] = {
+	KERNEL(u64, 8, ISA_BASE),
+#if defined(__x86_64__)
+	KERNEL(u64_nt, 8, ISA_BASE),
+	KERNEL(sse, 16, ISA_SSE41),
+	KERNEL(sse_nt, 16, ISA_SSE41),
+	KERNEL(avx2, 32, ISA_AVX2),
+	KERNEL(avx2_nt, 32, ISA_AVX2),
+	KERNEL(avx512, 64, ISA_AVX512),
+	KERNEL(avx512_nt, 64, ISA_AVX512),
+#endif
+};
+
+static bool kernel_supported(struct kernel *k)
+{
+#if defined(__x86_64__)
+	switch (k->isa) {
+	case ISA_SSE41:
+		return __builtin_cpu_supports("sse4.1");
+	case ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case ISA_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		break;
+	}
+#endif
+	return true;
+}
+
+enum op { OP_READ, OP_COPY_FROM, OP_WRITE, OP_COPY_TO };
+
+static const char *op_names[] = { "read", "copy-from", "write", "copy-to" };
+
+struct job {
+	pthread_t thread;
+	int *go;
+	struct kernel *kernel;
+	enum op op;
+	void *bar;
+	void *ram;
+	size_t len;
+	size_t block;
+	unsigned long msecs;
+	unsigned long bytes;
+	unsigned long nsecs;
+	struct lat_stats lat;
+};
+
+/* Sweep this thread's slice of the window one block at a time */
+static void *job_func(void *arg)
+{
+	struct job *job = arg;
+	struct kernel *k = job->kernel;
+	unsigned long start, end, before, after;
+	size_t off = 0;
+	int go;
+
+	/* Released together once all threads exist, or told to give up */
+	while (!(go = __atomic_load_n(job->go, __ATOMIC_ACQUIRE)))
+		;
+	if (go < 0)
+		return NULL;
+
+	start = before = now_nsec();
+	end = start + job->msecs * 1000000ul;
+
+	while (before < end) {
+		void *bar = job->bar + off, *ram = job->ram + off;
+
+		switch (job->op) {
+		case OP_READ:
+			k->read(bar, job->block);
+			break;
+		case OP_COPY_FROM:
+			k->copy(ram, bar, job->block);
+			break;
+		case OP_WRITE:
+			k->write(bar, job->block);
+			break;
+		case OP_COPY_TO:
+			k->copy(bar, ram, job->block);
+			break;
+		}
+
+		after = now_nsec();
+		lat_stats_add(&job->lat, after - before);
+		before = after;
+
+		job->bytes += job->block;
+		off += job->block;
+		if (off + job->block > job->len)
+			off = 0;
+	}
+
+	job->nsecs = before - start;
+	return NULL;
+}
+
+static int run(struct kernel *k, enum op op, void *bar, void *ram,
+	       size_t window, size_t block, int nr_threads,
+	       unsigned long msecs)
+{
+	struct job jobs[MAX_THREADS];
+	struct lat_stats all;
+	unsigned long bytes = 0, nsecs = 0, i;
+	/* Keep every slice aligned for the aligned vector kernels */
+	size_t slice = (window / nr_threads) & ~(size_t)63;
+	int t, j, go = 0;
+
+	if (slice < block)
+		return 0;
+
+	for (t = 0; t < nr_threads; t++) {
+		jobs[t] = (struct job){
+			.go = &go,
+			.kernel = k,
+			.op = op,
+			.bar = bar + t * slice,
+			.ram = ram + t * slice,
+			.len = slice,
+			.block = block,
+			.msecs = msecs,
+		};
+		lat_stats_init(&jobs[t].lat, 0);
+		if (pthread_create(&jobs[t].thread, NULL, job_func, &jobs[t])) {
+			printf("Failed to create thread %d\n", t);
+			__atomic_store_n(&go, -1, __ATOMIC_RELEASE);
+			for (j = 0; j < t; j++) {
+				pthread_join(jobs[j].thread, NULL);
+				lat_stats_free(&jobs[j].lat);
+			}
+			lat_stats_free(&jobs[t].lat);
+			return -1;
+		}
+	}
+
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	lat_stats_init(&all, 0);
+
+	for (t = 0; t < nr_threads; t++) {
+		pthread_join(jobs[t].thread, NULL);
+		bytes += jobs[t].bytes;
+		if (jobs[t].nsecs > nsecs)
+			nsecs = jobs[t].nsecs;
+		for (i = 0; i < jobs[t].lat.count; i++)
+			lat_stats_add(&all, jobs[t].lat.samples[i]);
+		lat_stats_free(&jobs[t].lat);
+	}
+
+	printf("\t%-9s %-9s %3zuB x %8zu thr %2d: %8.3f GB/s, "
+	       "%8.2f ns/access, block p50 %9.3fus p99 %9.3fus\n",
+	       op_names[op], k->name, k->width, block, nr_threads,
+	       (double)bytes / nsecs,
+	       (double)lat_stats_avg(&all) * k->width / block,
+	       lat_stats_pct(&all, 50) / 1000.0,
+	       lat_stats_pct(&all, 99) / 1000.0);
+	fflush(stdout);
+
+	lat_stats_free(&all);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	int container, device;
+	int i, j, t, opt, ret;
+	int max_threads = 1;
+	bool write = false;
+	size_t window = DEFAULT_WINDOW, len;
+	unsigned long msecs = DEFAULT_MSECS;
+	size_t blocks[] = { 64, 4096, 64 * 1024, 1024 * 1024, 0 }, *b;
+	struct vfio_device_info device_info = {	.argsz = sizeof(device_info) };
+	struct vfio_region_info region_info = { .argsz = sizeof(region_info) };
+	enum op op;
+	void *ram;
+
+	while ((opt = getopt(argc, argv, "wt:s:d:")) != -1) {
+		switch (opt) {
+		case 'w':
+			write = true;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			window = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'd':
+			msecs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || max_threads < 1 ||
+	    max_threads > MAX_THREADS || !window || !msecs) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	devname = argv[optind];
+
+	if (vfio_device_attach(devname, &container, &device, NULL))
+		return -1;
+
+	ret = ioctl(device, VFIO_DEVICE_GET_INFO, &device_info);
+	if (ret) {
+		printf("VFIO_DEVICE_GET_INFO failed: %d (%s)\n",
+		       ret, strerror(errno));
+		return -1;
+	}
+
+	ram = aligned_alloc(4096, window);
+	if (!ram) {
+		printf("Failed to allocate RAM buffer\n");
+		return -1;
+	}
+	memset(ram, 0, window);
+
+	for (i = 0; i < device_info.num_regions; i++) {
+		void *map;
+
+		region_info.index = i;
+		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &region_info))
+			continue;
+
+		if (!(region_info.flags & VFIO_REGION_INFO_FLAG_MMAP))
+			continue;
+
+		len = region_info.size < window ? region_info.size : window;
+
+		map = mmap(NULL, len, PROT_READ | (write ? PROT_WRITE : 0),
+			   MAP_SHARED, device, (off_t)region_info.offset);
+		if (map == MAP_FAILED) {
+			printf("Region %d: mmap failed: %s\n",
+			       i, strerror(errno));
+			continue;
+		}
+
+		printf("Region %d: size 0x%lx, using %ldKB\n", i,
+		       (unsigned long)region_info.size, len >> 10);
+
+		/* Fault everything in up front, this measures data movement */
+		mmap_touch(map, len, getpagesize());
+
+		for (op = OP_READ; op <= OP_COPY_TO; op++) {
+			if (!write && (op == OP_WRITE || op == OP_COPY_TO))
+				continue;
+
+			for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); j++) {
+				if (!kernel_supported(&kernels[j]))
+					continue;
+
+				for (b = blocks; *b; b++) {
+					for (t = 1; ; t *= 2) {
+						if (t > max_threads)
+							t = max_threads;
+						run(&kernels[j], op, map, ram,
+						    len, *b, t, msecs);
+						if (t == max_threads)
+							break;
+					}
+				}
+			}
+		}
+
+		munmap(map, len);
+	}
+
+	free(ram);
+	return 0;
+}
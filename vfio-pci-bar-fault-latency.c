@@ -0,0 +1,224 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define ALIGN_UP(x, a)  (((x) + (a) - 1) & ~((a) - 1))
+
+void usage(char *name)
+{
+	printf("usage: %s [-w] <ssss:bb:dd.f>\n", name);
+	printf("\t-w:   also measure write faults, each write stores the value\n"
+	       "\t      previously read via pread, which may still have side\n"
+	       "\t      effects on some devices\n");
+}
+
+/*
+ * Like mmap_align(), but the address is aligned to exactly align and
+ * deliberately misaligned to 2 * align, so the kernel can't use a larger
+ * page table entry than align would allow.  Returns the reservation base
+ * through base_out, which covers the mapping and must be unmapped with
+ * length + 3 * align.
+ */
+static void *mmap_exact_align(size_t length, int prot, int fd, off_t offset,
+			      size_t align, void **base_out)
+{
+	void *base, *addr, *map;
+
+	base = mmap(NULL, length + 3 * align, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return base;
+
+	addr = (void *)ALIGN_UP((uintptr_t)base, 2 * align) + align;
+
+	map = mmap(addr, length, prot, MAP_SHARED | MAP_FIXED, fd, offset);
+	if (map == MAP_FAILED) {
+		munmap(base, length + 3 * align);
+		return map;
+	}
+
+	*base_out = base;
+	return map;
+}
+
+static char *size_str(char *buf, size_t len, size_t size)
+{
+	if (size >= 1ul << 30)
+		snprintf(buf, len, "%ldG", size >> 30);
+	else if (size >= 1ul << 20)
+		snprintf(buf, len, "%ldM", size >> 20);
+	else
+		snprintf(buf, len, "%ldK", size >> 10);
+	return buf;
+}
+
+static int do_faults(int device, struct vfio_region_info *region,
+		     size_t align, bool write)
+{
+	int prot = PROT_READ | (write ? PROT_WRITE : 0);
+	size_t size = region->size, fault_size, off;
+	unsigned long before, faults;
+	char align_str[16], fault_str[16];
+	struct lat_stats lat;
+	uint32_t val = 0;
+	void *base, *map;
+
+	/* Probe the fault size on a throwaway mapping */
+	map = mmap_exact_align(size, PROT_READ, device,
+			       region->offset, align, &base);
+	if (map == MAP_FAILED) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return -1;
+	}
+	fault_size = mmap_fault_size(map, size);
+	munmap(base, size + 3 * align);
+
+	map = mmap_exact_align(size, prot, device, region->offset,
+			       align, &base);
+	if (map == MAP_FAILED) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (lat_stats_init(&lat, size / fault_size)) {
+		munmap(base, size + 3 * align);
+		return -1;
+	}
+
+	faults = thread_minflt();
+
+	for (off = 0; off < size; off += fault_size) {
+		if (write) {
+			if (pread(device, &val, sizeof(val),
+				  region->offset + off) != sizeof(val)) {
+				printf("pread failed at 0x%lx: %s\n",
+				       off, strerror(errno));
+				break;
+			}
+
+			before = now_nsec();
+			*(volatile uint32_t *)(map + off) = val;
+		} else {
+			before = now_nsec();
+			(void)*(volatile uint32_t *)(map + off);
+		}
+		lat_stats_add(&lat, now_nsec() - before);
+	}
+
+	faults = thread_minflt() - faults;
+
+	/* Total excludes the pread of the value to write back */
+	printf("\talign %4s %-5s: %7lu faults of %4s (%lu touches), "
+	       "touched in %3ld.%03lds\n",
+	       size_str(align_str, sizeof(align_str), align),
+	       write ? "write" : "read", faults,
+	       size_str(fault_str, sizeof(fault_str), fault_size),
+	       lat.count, lat.total / NSEC_PER_SEC,
+	       (lat.total % NSEC_PER_SEC) / USEC_PER_SEC);
+	lat_stats_print("fault", &lat);
+
+	lat_stats_free(&lat);
+	munmap(base, size + 3 * align);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	int container, device;
+	int i, j, opt, ret;
+	char size[16];
+	bool write = false;
+	struct vfio_device_info device_info = {	.argsz = sizeof(device_info) };
+	struct vfio_region_info region_info = { .argsz = sizeof(region_info) };
+	size_t aligns[] = {
+		4096,
+		2ul * 1024 * 1024,
+		1ul * 1024 * 1024 * 1024,
+		0
+	};
+
+	while ((opt = getopt(argc, argv, "w")) != -1) {
+		switch (opt) {
+		case 'w':
+			write = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	devname = argv[optind];
+	aligns[0] = getpagesize();
+
+	if (vfio_device_attach(devname, &container, &device, NULL))
+		return -1;
+
+	ret = ioctl(device, VFIO_DEVICE_GET_INFO, &device_info);
+	if (ret) {
+		printf("VFIO_DEVICE_GET_INFO failed: %d (%s)\n",
+		       ret, strerror(errno));
+		return -1;
+	}
+
+	if (!(device_info.flags & VFIO_DEVICE_FLAGS_PCI)) {
+		printf("Invalid vfio-pci device\n");
+		return -1;
+	}
+
+	for (i = VFIO_PCI_BAR0_REGION_INDEX; i <= VFIO_PCI_BAR5_REGION_INDEX &&
+	     i < device_info.num_regions; i++) {
+		region_info.index = i;
+		ret = ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &region_info);
+		if (ret) {
+			printf("VFIO_DEVICE_GET_REGION_INFO failed for region %d: %d (%s)\n",
+			       region_info.index, ret, strerror(errno));
+			continue;
+		}
+
+		if (!(region_info.flags & VFIO_REGION_INFO_FLAG_MMAP))
+			continue;
+
+		printf("BAR%d: size %s\n", i,
+		       size_str(size, sizeof(size), region_info.size));
+
+		for (j = 0; aligns[j]; j++) {
+			if (aligns[j] > region_info.size)
+				continue;
+
+			do_faults(device, &region_info, aligns[j], false);
+			if (write)
+				do_faults(device, &region_info, aligns[j], true);
+		}
+	}
+
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include <libgen.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,14 +35,37 @@ void usage(char *name)
 
 #define HIGH_MEM (4ul * 1024 * 1024 * 1024)
 
+static void print_size(size_t size)
+{
+	if (size >= 1ul << 30)
+		printf("%ldG", size >> 30);
+	else if (size >= 1ul << 20)
+		printf("%ldM", size >> 20);
+	else
+		printf("%ldK", size >> 10);
+}
+
+static void print_secs(const char *what, unsigned long nsecs)
+{
+	printf(" %s %3ld.%03lds", what, nsecs / NSEC_PER_SEC,
+	       (nsecs % NSEC_PER_SEC) / USEC_PER_SEC);
+}
+
+/*
+ * Map the BAR through the IOMMU in dma_size chunks, optionally faulting
+ * in the whole mmap first so the DMA map only has to look up PFNs rather
+ * than fault them in itself.  Faults are counted either way, which along
+ * with the probed fault size shows whether huge pfnmap entries were used.
+ */
 static void do_map_unmap(int container, int device,
 			 struct vfio_region_info *region,
 			 unsigned long iova_base,
-			 unsigned long dma_size)
+			 unsigned long dma_size, bool prefault)
 {
 	struct vfio_iommu_type1_dma_map dma_map = { 0 };
 	struct vfio_iommu_type1_dma_unmap dma_unmap = { 0 };
-	unsigned long before, after;
+	unsigned long before, after, faults;
+	size_t fault_size = 0;
 	int ret;
 
 	void *map = mmap_align(NULL, (size_t)region->size, PROT_READ, MAP_SHARED, device,
@@ -51,36 +75,65 @@ static void do_map_unmap(int container, int device,
 		return;
 	}
 
+	printf("\tdma size %9ldK %-5s", dma_size / 1024,
+	       prefault ? "warm" : "cold");
+
+	if (prefault) {
+		faults = thread_minflt();
+		before = now_nsec();
+		fault_size = mmap_fault_size(map, region->size);
+		mmap_touch(map, region->size, fault_size);
+		after = now_nsec();
+		faults = thread_minflt() - faults;
+
+		printf(" %7lu faults of ", faults);
+		print_size(fault_size);
+		print_secs("in", after - before);
+	}
+
 	dma_map.argsz = sizeof(dma_map);
 	dma_map.vaddr = (__u64)map;
 	dma_map.size = dma_size;
 	dma_map.iova = iova_base;
 	dma_map.flags = VFIO_DMA_MAP_FLAG_READ;
 
+	faults = thread_minflt();
 	before = now_nsec();
 	while (dma_map.iova < iova_base + region->size) {
 		ret = ioctl(container, VFIO_IOMMU_MAP_DMA, &dma_map);
 		if (ret) {
-			printf("VFIO_IOMMU_MAP_DMA failed at 0x%llx: %d (%s)\n",
+			printf("\nVFIO_IOMMU_MAP_DMA failed at 0x%llx: %d (%s)\n",
 			       dma_map.iova, ret, strerror(errno));
 			goto unmap;
 		}
+		dma_map.vaddr += dma_size;
 		dma_map.iova += dma_size;
 	}
 	after = now_nsec();
-
-	printf("\tdma size %9ldK mmapped in %3ld.%03lds\n", dma_size / 1024,
-	       (after - before) / NSEC_PER_SEC,
-	       ((after - before) % NSEC_PER_SEC) / USEC_PER_SEC);
+	faults = thread_minflt() - faults;
+
+	print_secs("mmapped in", after - before);
+	printf(" (%lu faults", faults);
+	if (faults) {
+		printf(", ~");
+		print_size(region->size / faults);
+		printf(" each");
+	}
+	printf(")");
 
 unmap:
 	dma_unmap.argsz = sizeof(dma_unmap);
 	dma_unmap.iova = iova_base;
 	dma_unmap.size = region->size;
+	before = now_nsec();
 	ret = ioctl(container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+	after = now_nsec();
 	if (ret) {
-		printf("VFIO_IOMMU_UNMAP_DMA failed at 0x%llx: %d (%s)\n",
+		printf("\nVFIO_IOMMU_UNMAP_DMA failed at 0x%llx: %d (%s)\n",
 		       dma_unmap.iova, ret, strerror(errno));
+	} else {
+		print_secs("unmapped in", after - before);
+		printf("\n");
 	}
 
 	munmap(map, (size_t)region->size);
@@ -141,7 +194,9 @@ int main(int argc, char **argv)
 				if (dma_sizes[j] > region_info.size)
 					continue;
 				do_map_unmap(container, device, &region_info,
-					     HIGH_MEM, dma_sizes[j]);
+					     HIGH_MEM, dma_sizes[j], false);
+				do_map_unmap(container, device, &region_info,
+					     HIGH_MEM, dma_sizes[j], true);
 			}
 		}
 	}
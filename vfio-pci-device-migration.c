@@ -8,19 +8,40 @@
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 
 #include <linux/vfio.h>
 
 #include "utils.h"
 
+#define MAX_BUF_SIZES 16
+#define DEFAULT_PRECOPY_ROUNDS 20
+#define DEFAULT_PRECOPY_INTERVAL 100
+#define DEFAULT_ARC_CYCLES 100
+#define MAX_DEVICES 16
+#define NR_MIG_STATES (VFIO_DEVICE_STATE_PRE_COPY_P2P + 1)
+
 void usage(char *name)
 {
-	printf("usage: %s <ssss:bb:dd.f>\n", name);
+	printf("usage: %s [-b KB[,KB...]] [-p] [-r rounds] [-i ms] [-a] "
+	       "[-n cycles] <ssss:bb:dd.f|mdev UUID> ...\n", name);
+	printf("\t-b:   data_fd read/write sizes, default 4,64,1024,8192\n");
+	printf("\t-p:   run pre-copy convergence, largest -b size for reads\n");
+	printf("\t-r:   max pre-copy rounds, default %d\n",
+	       DEFAULT_PRECOPY_ROUNDS);
+	printf("\t-i:   ms between pre-copy rounds, default %d\n",
+	       DEFAULT_PRECOPY_INTERVAL);
+	printf("\t-a:   time every FSM arc, per device and then across all\n"
+	       "\t      devices concurrently\n");
+	printf("\t-n:   arc timing cycles, default %d\n", DEFAULT_ARC_CYCLES);
 }
 
 static bool vfio_device_dma_logging_supported(int fd)
@@ -59,39 +80,734 @@ static int vfio_device_query_migration_flags(int fd, uint64_t *mig_flags)
 	return 0;
 }
 
+/*
+ * The saved device state, read straight from the data_fd into a growing
+ * buffer so the drain measures the device and not an extra copy.
+ */
+struct mig_image {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+static double mb_per_sec(size_t bytes, unsigned long nsecs)
+{
+	return nsecs ? (double)bytes * NSEC_PER_SEC / nsecs / (1024 * 1024) : 0;
+}
+
+static int mig_set_state(int device, uint32_t state, int *data_fd,
+			 unsigned long *nsecs)
+{
+	unsigned long before = now_nsec();
+	int ret;
+
+	ret = vfio_mig_set_state(device, state, data_fd);
+	if (nsecs)
+		*nsecs = now_nsec() - before;
+	if (ret)
+		printf("Failed to enter %s: %s\n", vfio_mig_state_name(state),
+		       strerror(-ret));
+	return ret;
+}
+
+static int drain(int data_fd, struct mig_image *image, size_t bufsize)
+{
+	ssize_t ret;
+	char *tmp;
+
+	image->len = 0;
+
+	for (;;) {
+		if (image->alloc - image->len < bufsize) {
+			size_t alloc = image->alloc ? image->alloc * 2 : bufsize;
+
+			while (alloc - image->len < bufsize)
+				alloc *= 2;
+
+			tmp = realloc(image->data, alloc);
+			if (!tmp) {
+				printf("Failed to grow image to %zu bytes\n",
+				       alloc);
+				return -ENOMEM;
+			}
+			image->data = tmp;
+			image->alloc = alloc;
+		}
+
+		ret = read(data_fd, image->data + image->len, bufsize);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("data_fd read failed: %m\n");
+			return -errno;
+		}
+		if (!ret)
+			return 0;
+
+		image->len += ret;
+	}
+}
+
+static int load(int data_fd, struct mig_image *image, size_t bufsize)
+{
+	size_t off = 0, len;
+	ssize_t ret;
+
+	while (off < image->len) {
+		len = image->len - off < bufsize ? image->len - off : bufsize;
+
+		ret = write(data_fd, image->data + off, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("data_fd write failed: %m\n");
+			return -errno;
+		}
+
+		off += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * RUNNING -> STOP -> STOP_COPY, drain the stream, then STOP -> RESUMING,
+ * write it back and STOP -> RUNNING.  Arcs are taken one at a time so
+ * each can be timed, the kernel would otherwise walk the intermediate
+ * states itself.  With P2P, RUNNING -> STOP is itself two arcs through
+ * RUNNING_P2P.
+ */
+static int save_restore(int device, uint64_t mig_flags, size_t bufsize,
+			struct mig_image *image)
+{
+	unsigned long p2p = 0, stop, stop_copy, save, resuming, restore;
+	unsigned long before, load_nsecs;
+	uint64_t estimate;
+	int data_fd, ret;
+	bool have_estimate;
+
+	if (mig_flags & VFIO_MIGRATION_P2P) {
+		ret = mig_set_state(device, VFIO_DEVICE_STATE_RUNNING_P2P,
+				    NULL, &p2p);
+		if (ret)
+			goto out_running;
+	}
+
+	ret = mig_set_state(device, VFIO_DEVICE_STATE_STOP, NULL, &stop);
+	if (ret)
+		goto out_running;
+
+	have_estimate = !vfio_mig_data_size(device, &estimate);
+
+	ret = mig_set_state(device, VFIO_DEVICE_STATE_STOP_COPY,
+			    &data_fd, &stop_copy);
+	if (ret)
+		goto out_running;
+
+	before = now_nsec();
+	ret = drain(data_fd, image, bufsize);
+	save = now_nsec() - before;
+	close(data_fd);
+	if (ret)
+		goto out_running;
+
+	ret = mig_set_state(device, VFIO_DEVICE_STATE_STOP, NULL, NULL);
+	if (ret)
+		goto out_running;
+
+	ret = mig_set_state(device, VFIO_DEVICE_STATE_RESUMING,
+			    &data_fd, &resuming);
+	if (ret)
+		goto out_running;
+
+	before = now_nsec();
+	ret = load(data_fd, image, bufsize);
+	restore = now_nsec() - before;
+	if (ret) {
+		close(data_fd);
+		goto out_running;
+	}
+
+	/* Leaving RESUMING is where the driver consumes the stream */
+	ret = mig_set_state(device, VFIO_DEVICE_STATE_STOP, NULL, &load_nsecs);
+	close(data_fd);
+	if (ret)
+		goto out_running;
+
+	printf("\t%zuKB buffer: state %zu bytes", bufsize / 1024, image->len);
+	if (have_estimate)
+		printf(" (estimate %llu)", (unsigned long long)estimate);
+	printf("\n");
+	if (mig_flags & VFIO_MIGRATION_P2P)
+		printf("\t\tRUNNING->RUNNING_P2P %.3fus, "
+		       "RUNNING_P2P->STOP %.3fus, STOP->STOP_COPY %.3fus\n",
+		       p2p / 1000.0, stop / 1000.0, stop_copy / 1000.0);
+	else
+		printf("\t\tRUNNING->STOP %.3fus, STOP->STOP_COPY %.3fus\n",
+		       stop / 1000.0, stop_copy / 1000.0);
+	printf("\t\tdrain %.3fus, %.2f MB/s\n",
+	       save / 1000.0, mb_per_sec(image->len, save));
+	printf("\t\tSTOP->RESUMING %.3fus, RESUMING->STOP %.3fus\n",
+	       resuming / 1000.0, load_nsecs / 1000.0);
+	printf("\t\trestore %.3fus, %.2f MB/s\n",
+	       restore / 1000.0, mb_per_sec(image->len, restore));
+	fflush(stdout);
+
+out_running:
+	/* Best effort, a failed arc may have left the device in ERROR */
+	if (vfio_mig_set_state(device, VFIO_DEVICE_STATE_RUNNING, NULL) &&
+	    !vfio_mig_set_state(device, VFIO_DEVICE_STATE_STOP, NULL))
+		vfio_mig_set_state(device, VFIO_DEVICE_STATE_RUNNING, NULL);
+	return ret;
+}
+
+/*
+ * Read what the device has available now, at most max bytes.  In PRE_COPY
+ * a read with nothing pending fails with ENOMSG rather than blocking.
+ */
+static ssize_t read_avail(int data_fd, char *buf, size_t bufsize, size_t max)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while (total < max) {
+		ret = read(data_fd, buf, max - total < bufsize ?
+					 max - total : bufsize);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOMSG)
+				break;
+			printf("data_fd read failed: %m\n");
+			return -errno;
+		}
+		if (!ret)
+			break;
+		total += ret;
+	}
+
+	return total;
+}
+
+/*
+ * Enter PRE_COPY with the device running and read the stream in rounds.
+ * Each round samples VFIO_MIG_GET_PRECOPY_INFO, where initial_bytes is
+ * what's left of the first pass and dirty_bytes what the device has dirtied
+ * since, reads that much and sleeps to let the device dirty more.  Pre-copy
+ * has converged once the initial data is gone and the dirty data stops
+ * shrinking, which is when a cut-over to STOP_COPY is cheapest.  The cut
+ * over is then taken on the same data_fd, comparing the STOP_COPY stream
+ * to the last MIG_DATA_SIZE prediction.
+ */
+static int precopy(int device, size_t bufsize, unsigned int rounds,
+		   unsigned int interval)
+{
+	struct vfio_precopy_info info = { .argsz = sizeof(info) };
+	unsigned long start, before, nsecs;
+	uint64_t estimate = 0, last_dirty = UINT64_MAX, total = 0;
+	bool have_estimate = false;
+	unsigned int round;
+	int data_fd, ret;
+	ssize_t bytes;
+	char *buf;
+
+	buf = malloc(bufsize);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = mig_set_state(device, VFIO_DEVICE_STATE_PRE_COPY,
+			    &data_fd, NULL);
+	if (ret)
+		goto out_free;
+
+	printf("Pre-copy, %zuKB reads, %ums interval:\n",
+	       bufsize / 1024, interval);
+	printf("\t%5s %10s %14s %14s %14s %14s\n", "round", "ms",
+	       "initial", "dirty", "read", "stop-copy est");
+
+	start = now_nsec();
+
+	for (round = 0; round < rounds; round++) {
+		if (ioctl(data_fd, VFIO_MIG_GET_PRECOPY_INFO, &info)) {
+			printf("VFIO_MIG_GET_PRECOPY_INFO failed: %m\n");
+			ret = -errno;
+			goto out_close;
+		}
+
+		have_estimate = !vfio_mig_data_size(device, &estimate);
+
+		bytes = read_avail(data_fd, buf, bufsize,
+				   info.initial_bytes + info.dirty_bytes);
+		if (bytes < 0) {
+			ret = bytes;
+			goto out_close;
+		}
+		total += bytes;
+
+		printf("\t%5u %10.1f %14llu %14llu %14zd ", round,
+		       (now_nsec() - start) / 1000000.0,
+		       (unsigned long long)info.initial_bytes,
+		       (unsigned long long)info.dirty_bytes, bytes);
+		if (have_estimate)
+			printf("%14llu\n", (unsigned long long)estimate);
+		else
+			printf("%14s\n", "-");
+
+		if (!info.initial_bytes &&
+		    (!info.dirty_bytes || info.dirty_bytes >= last_dirty)) {
+			printf("\tConverged after %u rounds\n", round + 1);
+			break;
+		}
+		last_dirty = info.initial_bytes ? UINT64_MAX : info.dirty_bytes;
+
+		usleep(interval * 1000);
+	}
+
+	if (round == rounds)
+		printf("\tNot converged after %u rounds\n", rounds);
+
+	printf("\tPre-copy: %llu bytes in %.1fms\n", (unsigned long long)total,
+	       (now_nsec() - start) / 1000000.0);
+
+	ret = mig_set_state(device, VFIO_DEVICE_STATE_STOP_COPY, NULL, &nsecs);
+	if (ret)
+		goto out_close;
+
+	before = now_nsec();
+	bytes = read_avail(data_fd, buf, bufsize, SIZE_MAX);
+	if (bytes < 0) {
+		ret = bytes;
+		goto out_close;
+	}
+	nsecs += now_nsec() - before;
+
+	printf("\tStop-copy: %zd bytes", bytes);
+	if (have_estimate)
+		printf(", predicted %llu", (unsigned long long)estimate);
+	printf(", %.3fus to cut over and drain\n", nsecs / 1000.0);
+	fflush(stdout);
+
+out_close:
+	close(data_fd);
+	if (vfio_mig_set_state(device, VFIO_DEVICE_STATE_RUNNING, NULL) &&
+	    !vfio_mig_set_state(device, VFIO_DEVICE_STATE_STOP, NULL))
+		vfio_mig_set_state(device, VFIO_DEVICE_STATE_RUNNING, NULL);
+out_free:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Cycles from RUNNING back to RUNNING which between them take every arc
+ * of the FSM once, ERROR terminates the list.  The kernel walks multi-arc
+ * transitions itself, so each step here must be a single arc.  With P2P
+ * supported, RUNNING <-> STOP and PRE_COPY -> STOP_COPY go through the P2P
+ * states and are covered by the P2P paths instead.
+ */
+#define MIG_PATH_MAX 9
+
+/* Append the terminator, failing the build if there's no room for it */
+#define MIG_PATH(_flags, _excluded, ...)				\
+	{								\
+		.flags = (_flags),					\
+		.excluded = (_excluded) + 0 * sizeof(struct {		\
+			_Static_assert(sizeof((uint32_t[]){ __VA_ARGS__ }) < \
+				       MIG_PATH_MAX * sizeof(uint32_t),	\
+				       "mig_path has no room for ERROR"); \
+			int unused;					\
+		}),							\
+		.states = { __VA_ARGS__, VFIO_DEVICE_STATE_ERROR },	\
+	}
+
+static const struct mig_path {
+	uint64_t flags;
+	uint64_t excluded;
+	uint32_t states[MIG_PATH_MAX];
+} mig_paths[] = {
+	MIG_PATH(0, VFIO_MIGRATION_P2P,
+		 VFIO_DEVICE_STATE_STOP, VFIO_DEVICE_STATE_RUNNING),
+	MIG_PATH(VFIO_MIGRATION_P2P, 0,
+		 VFIO_DEVICE_STATE_RUNNING_P2P, VFIO_DEVICE_STATE_STOP,
+		 VFIO_DEVICE_STATE_STOP_COPY, VFIO_DEVICE_STATE_STOP,
+		 VFIO_DEVICE_STATE_RESUMING, VFIO_DEVICE_STATE_STOP,
+		 VFIO_DEVICE_STATE_RUNNING_P2P, VFIO_DEVICE_STATE_RUNNING),
+	MIG_PATH(0, VFIO_MIGRATION_P2P,
+		 VFIO_DEVICE_STATE_STOP, VFIO_DEVICE_STATE_STOP_COPY,
+		 VFIO_DEVICE_STATE_STOP, VFIO_DEVICE_STATE_RESUMING,
+		 VFIO_DEVICE_STATE_STOP, VFIO_DEVICE_STATE_RUNNING),
+	MIG_PATH(VFIO_MIGRATION_PRE_COPY, 0,
+		 VFIO_DEVICE_STATE_PRE_COPY, VFIO_DEVICE_STATE_RUNNING),
+	MIG_PATH(VFIO_MIGRATION_PRE_COPY, VFIO_MIGRATION_P2P,
+		 VFIO_DEVICE_STATE_PRE_COPY, VFIO_DEVICE_STATE_STOP_COPY,
+		 VFIO_DEVICE_STATE_STOP, VFIO_DEVICE_STATE_RUNNING),
+	MIG_PATH(VFIO_MIGRATION_PRE_COPY | VFIO_MIGRATION_P2P, 0,
+		 VFIO_DEVICE_STATE_RUNNING_P2P, VFIO_DEVICE_STATE_PRE_COPY_P2P,
+		 VFIO_DEVICE_STATE_PRE_COPY, VFIO_DEVICE_STATE_PRE_COPY_P2P,
+		 VFIO_DEVICE_STATE_RUNNING_P2P, VFIO_DEVICE_STATE_RUNNING),
+	MIG_PATH(VFIO_MIGRATION_PRE_COPY | VFIO_MIGRATION_P2P, 0,
+		 VFIO_DEVICE_STATE_PRE_COPY, VFIO_DEVICE_STATE_PRE_COPY_P2P,
+		 VFIO_DEVICE_STATE_STOP_COPY, VFIO_DEVICE_STATE_STOP,
+		 VFIO_DEVICE_STATE_RUNNING_P2P, VFIO_DEVICE_STATE_RUNNING),
+};
+
+struct mig_dev {
+	const char *name;
+	int device;
+	uint64_t flags;
+	uint32_t state;
+	int data_fd;
+	struct mig_image image;
+	struct lat_stats arcs[NR_MIG_STATES][NR_MIG_STATES];
+	struct arc_run *run;
+	pthread_t thread;
+	unsigned long start, end;
+};
+
+/*
+ * Devices step through the same paths in lockstep, a barrier releases each
+ * arc on every device at once and the coordinated time is from the first
+ * device starting the arc to the last one finishing, what a VMM stopping
+ * all of a VM's devices would see.
+ */
+struct arc_run {
+	struct mig_dev **devs;
+	int nr_devs;
+	uint64_t flags;
+	unsigned long cycles;
+	pthread_barrier_t barrier;
+	bool failed;
+	struct lat_stats coord[NR_MIG_STATES][NR_MIG_STATES];
+};
+
+static void arc_stats_init(struct lat_stats arcs[][NR_MIG_STATES],
+			   unsigned long hint)
+{
+	int i, j;
+
+	for (i = 0; i < NR_MIG_STATES; i++)
+		for (j = 0; j < NR_MIG_STATES; j++)
+			lat_stats_init(&arcs[i][j], hint);
+}
+
+static void arc_stats_print(struct lat_stats arcs[][NR_MIG_STATES])
+{
+	char name[64];
+	int i, j;
+
+	for (i = 0; i < NR_MIG_STATES; i++) {
+		for (j = 0; j < NR_MIG_STATES; j++) {
+			if (!arcs[i][j].count)
+				continue;
+			snprintf(name, sizeof(name), "%s->%s",
+				 vfio_mig_state_name(i),
+				 vfio_mig_state_name(j));
+			lat_stats_print(name, &arcs[i][j]);
+		}
+	}
+	fflush(stdout);
+}
+
+static void arc_stats_free(struct lat_stats arcs[][NR_MIG_STATES])
+{
+	int i, j;
+
+	for (i = 0; i < NR_MIG_STATES; i++)
+		for (j = 0; j < NR_MIG_STATES; j++)
+			lat_stats_free(&arcs[i][j]);
+}
+
+/*
+ * Take and time one arc.  STOP_COPY is drained into the image outside the
+ * timing and fed back on RESUMING so the driver has a valid stream to load.
+ */
+static int arc_step(struct mig_dev *dev, uint32_t state)
+{
+	int data_fd, ret;
+
+	dev->start = now_nsec();
+	ret = vfio_mig_set_state(dev->device, state, &data_fd);
+	dev->end = now_nsec();
+	if (ret) {
+		printf("%s: %s->%s failed: %s\n", dev->name,
+		       vfio_mig_state_name(dev->state),
+		       vfio_mig_state_name(state), strerror(-ret));
+		return ret;
+	}
+
+	lat_stats_add(&dev->arcs[dev->state][state], dev->end - dev->start);
+	dev->state = state;
+
+	if (data_fd >= 0) {
+		if (dev->data_fd >= 0)
+			close(dev->data_fd);
+		dev->data_fd = data_fd;
+	} else if (state == VFIO_DEVICE_STATE_RUNNING ||
+		   state == VFIO_DEVICE_STATE_RUNNING_P2P ||
+		   state == VFIO_DEVICE_STATE_STOP) {
+		if (dev->data_fd >= 0)
+			close(dev->data_fd);
+		dev->data_fd = -1;
+	}
+
+	if (state == VFIO_DEVICE_STATE_STOP_COPY)
+		return drain(dev->data_fd, &dev->image, 1 << 20);
+	if (state == VFIO_DEVICE_STATE_RESUMING)
+		return load(dev->data_fd, &dev->image, 1 << 20);
+
+	return 0;
+}
+
+static void *arc_func(void *arg)
+{
+	struct mig_dev *dev = arg;
+	struct arc_run *run = dev->run;
+	unsigned long cycle, start, end;
+	const uint32_t *state;
+	int i, p;
+
+	for (cycle = 0; cycle < run->cycles; cycle++) {
+		for (p = 0; p < sizeof(mig_paths) / sizeof(mig_paths[0]); p++) {
+			if ((mig_paths[p].flags & run->flags) !=
+			    mig_paths[p].flags ||
+			    mig_paths[p].excluded & run->flags)
+				continue;
+
+			for (state = mig_paths[p].states; *state; state++) {
+				uint32_t from = dev->state;
+
+				pthread_barrier_wait(&run->barrier);
+				if (arc_step(dev, *state))
+					__atomic_store_n(&run->failed, true,
+							 __ATOMIC_RELAXED);
+				pthread_barrier_wait(&run->barrier);
+
+				if (__atomic_load_n(&run->failed,
+						    __ATOMIC_RELAXED))
+					return NULL;
+
+				if (dev != run->devs[0] || run->nr_devs == 1)
+					continue;
+
+				start = ULONG_MAX;
+				end = 0;
+				for (i = 0; i < run->nr_devs; i++) {
+					if (run->devs[i]->start < start)
+						start = run->devs[i]->start;
+					if (run->devs[i]->end > end)
+						end = run->devs[i]->end;
+				}
+				lat_stats_add(&run->coord[from][*state],
+					      end - start);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Only the features all devices share are exercised */
+static int run_arcs(struct mig_dev **devs, int nr_devs, unsigned long cycles)
+{
+	struct arc_run run = {
+		.devs = devs,
+		.nr_devs = nr_devs,
+		.flags = ~0ULL,
+		.cycles = cycles,
+	};
+	int i;
+
+	for (i = 0; i < nr_devs; i++) {
+		run.flags &= devs[i]->flags;
+		devs[i]->run = &run;
+		devs[i]->state = VFIO_DEVICE_STATE_RUNNING;
+		devs[i]->data_fd = -1;
+		arc_stats_init(devs[i]->arcs, cycles);
+	}
+
+	arc_stats_init(run.coord, nr_devs > 1 ? cycles : 0);
+	pthread_barrier_init(&run.barrier, NULL, nr_devs);
+
+	for (i = 0; i < nr_devs; i++) {
+		if (pthread_create(&devs[i]->thread, NULL, arc_func, devs[i])) {
+			printf("Failed to create thread\n");
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < nr_devs; i++)
+		pthread_join(devs[i]->thread, NULL);
+
+	pthread_barrier_destroy(&run.barrier);
+
+	if (nr_devs == 1) {
+		printf("%s arcs, %lu cycles:\n", devs[0]->name, cycles);
+		arc_stats_print(devs[0]->arcs);
+	} else {
+		printf("%d devices concurrently, %lu cycles:\n",
+		       nr_devs, cycles);
+		arc_stats_print(run.coord);
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		if (devs[i]->data_fd >= 0)
+			close(devs[i]->data_fd);
+		if (devs[i]->state != VFIO_DEVICE_STATE_RUNNING &&
+		    vfio_mig_set_state(devs[i]->device,
+				       VFIO_DEVICE_STATE_RUNNING, NULL) &&
+		    !vfio_mig_set_state(devs[i]->device,
+					VFIO_DEVICE_STATE_STOP, NULL))
+			vfio_mig_set_state(devs[i]->device,
+					   VFIO_DEVICE_STATE_RUNNING, NULL);
+		arc_stats_free(devs[i]->arcs);
+	}
+
+	arc_stats_free(run.coord);
+	return run.failed ? -1 : 0;
+}
+
+static int parse_sizes(char *arg, size_t *sizes)
+{
+	char *tok, *save;
+	int nr = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (nr == MAX_BUF_SIZES)
+			return -1;
+		sizes[nr] = strtoul(tok, NULL, 0) * 1024;
+		if (!sizes[nr])
+			return -1;
+		nr++;
+	}
+
+	return nr ? nr : -1;
+}
+
 int main(int argc, char **argv)
 {
 	const char *devname;
-	int device;
+	int device, d, i, opt, nr_sizes = 4, nr_devs = 0;
+	unsigned int rounds = DEFAULT_PRECOPY_ROUNDS;
+	unsigned int interval = DEFAULT_PRECOPY_INTERVAL;
+	unsigned long cycles = DEFAULT_ARC_CYCLES;
+	bool do_precopy = false, do_arcs = false;
+	size_t sizes[MAX_BUF_SIZES] = { 4096, 65536, 1 << 20, 8 << 20 };
+	struct mig_dev devs[MAX_DEVICES] = {}, *arc_devs[MAX_DEVICES];
+	struct mig_image image = {};
 	uint64_t mig_flags;
-	
-	if (argc < 2) {
+	uint32_t state;
+
+	while ((opt = getopt(argc, argv, "b:pr:i:an:")) != -1) {
+		switch (opt) {
+		case 'b':
+			nr_sizes = parse_sizes(optarg, sizes);
+			break;
+		case 'p':
+			do_precopy = true;
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			do_arcs = true;
+			break;
+		case 'n':
+			cycles = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind == argc || argc - optind > MAX_DEVICES || nr_sizes < 0 ||
+	    !rounds || !cycles) {
 		usage(argv[0]);
 		return -1;
 	}
 
-	devname = argv[1];
-	
-	if (vfio_device_attach(devname, NULL, &device, NULL))
-		return -1;
-	
-	if (vfio_device_query_migration_flags(device, &mig_flags))
-		return -1;
+	for (d = optind; d < argc; d++) {
+		devname = argv[d];
 
-	if (mig_flags) {
-		printf("Migration features:\n");
-		if (mig_flags & VFIO_MIGRATION_STOP_COPY)
-			printf("\tstop-copy\n");
-		if (mig_flags & VFIO_MIGRATION_P2P)
-			printf("\tp2p\n");
-		if (mig_flags & VFIO_MIGRATION_PRE_COPY)
-			printf("\tpre-copy\n");
-		if (vfio_device_dma_logging_supported(device))
-			printf("\tdirty-tracking\n");
-	} else {
-		printf("No migration support\n");
+		if (vfio_device_attach(devname, NULL, &device, NULL))
+			return -1;
+
+		if (vfio_device_query_migration_flags(device, &mig_flags))
+			return -1;
+
+		if (argc - optind > 1)
+			printf("%s:\n", devname);
+
+		if (mig_flags) {
+			printf("Migration features:\n");
+			if (mig_flags & VFIO_MIGRATION_STOP_COPY)
+				printf("\tstop-copy\n");
+			if (mig_flags & VFIO_MIGRATION_P2P)
+				printf("\tp2p\n");
+			if (mig_flags & VFIO_MIGRATION_PRE_COPY)
+				printf("\tpre-copy\n");
+			if (vfio_device_dma_logging_supported(device))
+				printf("\tdirty-tracking\n");
+		} else {
+			printf("No migration support\n");
+		}
+
+		if (!(mig_flags & VFIO_MIGRATION_STOP_COPY))
+			continue;
+
+		if (vfio_mig_get_state(device, &state) ||
+		    (state != VFIO_DEVICE_STATE_RUNNING &&
+		     mig_set_state(device, VFIO_DEVICE_STATE_RUNNING,
+				   NULL, NULL))) {
+			printf("Failed to put device in RUNNING\n");
+			return -1;
+		}
+
+		printf("Save/restore:\n");
+		for (i = 0; i < nr_sizes; i++)
+			if (save_restore(device, mig_flags, sizes[i], &image))
+				return -1;
+
+		if (do_precopy) {
+			size_t bufsize = 0;
+
+			if (!(mig_flags & VFIO_MIGRATION_PRE_COPY)) {
+				printf("Pre-copy not supported\n");
+				return -1;
+			}
+
+			for (i = 0; i < nr_sizes; i++)
+				if (sizes[i] > bufsize)
+					bufsize = sizes[i];
+
+			if (precopy(device, bufsize, rounds, interval))
+				return -1;
+		}
+
+		devs[nr_devs].name = devname;
+		devs[nr_devs].device = device;
+		devs[nr_devs].flags = mig_flags;
+		nr_devs++;
+	}
+
+	free(image.data);
+
+	if (do_arcs) {
+		for (i = 0; i < nr_devs; i++) {
+			arc_devs[i] = &devs[i];
+			if (run_arcs(&arc_devs[i], 1, cycles))
+				return -1;
+		}
+
+		if (nr_devs > 1 && run_arcs(arc_devs, nr_devs, cycles))
+			return -1;
+
+		for (i = 0; i < nr_devs; i++)
+			free(devs[i].image.data);
 	}
-		
 
 	printf("Success\n");
 	return 0;
@@ -0,0 +1,280 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/iommufd.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define DEFAULT_ITERATIONS 100
+
+void usage(char *name)
+{
+	printf("usage: %s [-n iterations] <ssss:bb:dd.f>\n", name);
+	printf("\t-n:   open/close cycles per path, default %d\n",
+	       DEFAULT_ITERATIONS);
+}
+
+/*
+ * The first open of a device runs the driver's open_device, enabling the
+ * device and resetting it where a function reset is available, and the
+ * last close runs close_device, which resets it again.  Opening a second
+ * fd while one is held skips both, leaving only the fd overhead, and
+ * VFIO_DEVICE_RESET on a held fd times the reset alone.  The differences
+ * break down where the open/close time goes.
+ */
+struct churn_stats {
+	struct lat_stats open;
+	struct lat_stats close;
+	struct lat_stats warm_open;
+	struct lat_stats warm_close;
+	struct lat_stats reset;
+};
+
+static void churn_stats_init(struct churn_stats *s, unsigned long n)
+{
+	lat_stats_init(&s->open, n);
+	lat_stats_init(&s->close, n);
+	lat_stats_init(&s->warm_open, n);
+	lat_stats_init(&s->warm_close, n);
+	lat_stats_init(&s->reset, n);
+}
+
+static void churn_stats_free(struct churn_stats *s)
+{
+	lat_stats_free(&s->open);
+	lat_stats_free(&s->close);
+	lat_stats_free(&s->warm_open);
+	lat_stats_free(&s->warm_close);
+	lat_stats_free(&s->reset);
+}
+
+static void print_breakdown(const char *what, struct lat_stats *cold,
+			    struct lat_stats *warm, struct lat_stats *reset)
+{
+	long dev = lat_stats_avg(cold) - lat_stats_avg(warm);
+
+	printf("\t%s: %.3fus in the driver", what, dev / 1000.0);
+	if (reset->count)
+		printf(", of which ~%.3fus function reset",
+		       lat_stats_avg(reset) / 1000.0);
+	printf("\n");
+}
+
+static int churn_group(const char *devname, unsigned long iterations)
+{
+	struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
+	struct churn_stats s;
+	unsigned long i, before;
+	int container, group, device, held, ret = -1;
+
+	if (vfio_device_attach(devname, &container, NULL, &group))
+		return -1;
+
+	churn_stats_init(&s, iterations);
+
+	for (i = 0; i < iterations; i++) {
+		before = now_nsec();
+		device = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, devname);
+		if (device < 0) {
+			printf("Failed to get device %s: %s\n",
+			       devname, strerror(errno));
+			goto out;
+		}
+		lat_stats_add(&s.open, now_nsec() - before);
+
+		before = now_nsec();
+		close(device);
+		lat_stats_add(&s.close, now_nsec() - before);
+	}
+
+	held = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, devname);
+	if (held < 0) {
+		printf("Failed to get device %s: %s\n",
+		       devname, strerror(errno));
+		goto out;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		before = now_nsec();
+		device = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, devname);
+		if (device < 0)
+			break;
+		lat_stats_add(&s.warm_open, now_nsec() - before);
+
+		before = now_nsec();
+		close(device);
+		lat_stats_add(&s.warm_close, now_nsec() - before);
+	}
+
+	if (!ioctl(held, VFIO_DEVICE_GET_INFO, &device_info) &&
+	    device_info.flags & VFIO_DEVICE_FLAGS_RESET) {
+		for (i = 0; i < iterations; i++) {
+			before = now_nsec();
+			if (ioctl(held, VFIO_DEVICE_RESET))
+				break;
+			lat_stats_add(&s.reset, now_nsec() - before);
+		}
+	}
+
+	close(held);
+
+	printf("Group path, %lu cycles:\n", iterations);
+	lat_stats_print("GET_DEVICE_FD", &s.open);
+	lat_stats_print("close", &s.close);
+	lat_stats_print("GET_DEVICE_FD held", &s.warm_open);
+	lat_stats_print("close held", &s.warm_close);
+	if (s.reset.count)
+		lat_stats_print("VFIO_DEVICE_RESET", &s.reset);
+	else
+		printf("\tNo function reset available\n");
+	print_breakdown("open_device", &s.open, &s.warm_open, &s.reset);
+	print_breakdown("close_device", &s.close, &s.warm_close, &s.reset);
+	fflush(stdout);
+	ret = 0;
+
+out:
+	churn_stats_free(&s);
+	close(group);
+	close(container);
+	return ret;
+}
+
+/*
+ * The cdev path can't open a device twice, so there's no held variant,
+ * instead each stage of bringing up the device is timed.  open_device runs
+ * at bind.
+ */
+static int churn_cdev(const char *devname, unsigned long iterations)
+{
+	struct iommu_ioas_alloc alloc = { .size = sizeof(alloc) };
+	struct lat_stats open_lat, bind_lat, attach_lat, close_lat;
+	unsigned long i, before;
+	int iommufd, device, ret = -1;
+	char cdev[PATH_MAX];
+
+	if (vfio_device_cdev_path(devname, cdev, sizeof(cdev)))
+		return -1;
+
+	iommufd = iommufd_open();
+	if (iommufd < 0)
+		return -1;
+
+	if (ioctl(iommufd, IOMMU_IOAS_ALLOC, &alloc)) {
+		printf("Failed IOMMU_IOAS_ALLOC (%s)\n", strerror(errno));
+		close(iommufd);
+		return -1;
+	}
+
+	lat_stats_init(&open_lat, iterations);
+	lat_stats_init(&bind_lat, iterations);
+	lat_stats_init(&attach_lat, iterations);
+	lat_stats_init(&close_lat, iterations);
+
+	for (i = 0; i < iterations; i++) {
+		struct vfio_device_bind_iommufd bind = {
+			.argsz = sizeof(bind),
+			.iommufd = iommufd,
+		};
+		struct vfio_device_attach_iommufd_pt attach = {
+			.argsz = sizeof(attach),
+			.pt_id = alloc.out_ioas_id,
+		};
+
+		before = now_nsec();
+		device = open(cdev, O_RDWR);
+		if (device < 0) {
+			printf("Failed to open %s (%s)\n", cdev, strerror(errno));
+			goto out;
+		}
+		lat_stats_add(&open_lat, now_nsec() - before);
+
+		before = now_nsec();
+		if (ioctl(device, VFIO_DEVICE_BIND_IOMMUFD, &bind)) {
+			printf("Failed VFIO_DEVICE_BIND_IOMMUFD (%s)\n",
+			       strerror(errno));
+			close(device);
+			goto out;
+		}
+		lat_stats_add(&bind_lat, now_nsec() - before);
+
+		before = now_nsec();
+		if (ioctl(device, VFIO_DEVICE_ATTACH_IOMMUFD_PT, &attach)) {
+			printf("Failed VFIO_DEVICE_ATTACH_IOMMUFD_PT (%s)\n",
+			       strerror(errno));
+			close(device);
+			goto out;
+		}
+		lat_stats_add(&attach_lat, now_nsec() - before);
+
+		before = now_nsec();
+		close(device);
+		lat_stats_add(&close_lat, now_nsec() - before);
+	}
+
+	printf("cdev + iommufd path, %lu cycles:\n", iterations);
+	lat_stats_print("open cdev", &open_lat);
+	lat_stats_print("BIND_IOMMUFD", &bind_lat);
+	lat_stats_print("ATTACH_IOMMUFD_PT", &attach_lat);
+	lat_stats_print("close", &close_lat);
+	fflush(stdout);
+	ret = 0;
+
+out:
+	lat_stats_free(&open_lat);
+	lat_stats_free(&bind_lat);
+	lat_stats_free(&attach_lat);
+	lat_stats_free(&close_lat);
+	close(iommufd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !iterations) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	devname = argv[optind];
+
+	/* The group must be released before the cdev can bind */
+	ret = churn_group(devname, iterations);
+	if (churn_cdev(devname, iterations))
+		ret = -1;
+
+	return ret;
+}
@@ -32,14 +32,17 @@ void usage(char *name)
 	printf("usage: %s <ssss:bb:dd.f>\n", name);
 }
 
+#define PCI_VENDOR_ID_INTEL 0x8086
+
 int main(int argc, char **argv)
 {
 	const char *devname;
 	int container, device;
 	int i;
-	int ret;
-	struct vfio_device_info device_info = {	.argsz = sizeof(device_info) };
-	struct vfio_region_info region_info = { .argsz = sizeof(region_info) };
+	struct vfio_regions regions;
+	struct vfio_region *config, *opregion;
+	char sig[17];
+	unsigned size, tmp;
 
 	if (argc < 2) {
 		usage(argv[0]);
@@ -51,128 +54,79 @@ int main(int argc, char **argv)
 	if (vfio_device_attach(devname, &container, &device, NULL))
 		return -1;
 
-	ret = ioctl(device, VFIO_DEVICE_GET_INFO, &device_info);
-	if (ret) {
-		printf("VFIO_DEVICE_GET_INFO failed: %d (%s)\n",
-		       ret, strerror(errno));
+	if (vfio_regions_get(device, &regions))
 		return -1;
-	}
 
-	printf("Device %s supports %d regions, %d irqs\n", devname,
-	       device_info.num_regions, device_info.num_irqs);
+	printf("Device %s supports %d regions\n", devname, regions.nr);
 
-	for (i = 0; i < device_info.num_regions; i++) {
-		unsigned long config_offset;
-		char sig[17];
-		unsigned size, tmp;
+	for (i = 0; i < regions.nr; i++) {
+		struct vfio_region *region = vfio_region(&regions, i);
 
 		printf("Region %d: ", i);
-		region_info.index = i;
-		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &region_info)) {
+		if (!region) {
 			printf("Failed to get info\n");
 			continue;
 		}
 
 		printf("size 0x%lx, offset 0x%lx, flags 0x%x\n",
-		       (unsigned long)region_info.size,
-		       (unsigned long)region_info.offset, region_info.flags);
-
-		if (i == VFIO_PCI_CONFIG_REGION_INDEX)
-			config_offset = region_info.offset;
-
-		if (region_info.flags & VFIO_REGION_INFO_FLAG_CAPS) {
-			struct vfio_region_info *region;
-			void *buf;
-			struct vfio_info_cap_header *header;
-			struct vfio_region_info_cap_type *type;
-
-			printf("Found caps flag, realloc %d bytes\n",
-				region_info.argsz);
-
-
-			buf = region = malloc(region_info.argsz);
-			if (!region) {
-				printf("Can't new buffer\n");
-				return -1;
-			}
-
-			region->argsz = region_info.argsz;
-			region->index = i;
-
-			if (ioctl(device,
-			          VFIO_DEVICE_GET_REGION_INFO, region)) {
-
-				printf("Failed to re-get info\n");
-				return -1;
-			}
-
-			if (region->argsz != region_info.argsz) {
-				printf("Size changed!?\n");
-				return -1;
-			}
-
-			if (!(region->flags & VFIO_REGION_INFO_FLAG_CAPS)) {
-				printf("Caps disappeared?!\n");
-				return -1;
-			}
-
-			printf("First cap @%x\n", region->cap_offset);
-
-			header = buf + region->cap_offset;
-
-			printf("header ID %x version %x next %x\n",
-			       header->id, header->version, header->next);
-
-			if (header->id != VFIO_REGION_INFO_CAP_TYPE) {
-				printf("Unexpected ID, this code doesn't walk the chain\n");
-				return -1;
-			}
-
+		       (unsigned long)region->info->size,
+		       (unsigned long)region->info->offset,
+		       region->info->flags);
 
-			type = (struct vfio_region_info_cap_type *)header;
-
-			printf("Type %x, sub-type %x\n",
-			       type->type, type->subtype);
+		if (region->type)
+			printf("\tType %x, sub-type %x\n",
+			       region->type->type, region->type->subtype);
+	}
 
+	config = vfio_region(&regions, VFIO_PCI_CONFIG_REGION_INDEX);
+	if (!config) {
+		printf("No config space region\n");
+		return -1;
+	}
 
-			if (pread(device, sig, 16, region->offset) != 16) {
-				printf("failed to read signature\n");
-				return -1;
-			}
+	opregion = vfio_region_find_type(&regions,
+					 VFIO_REGION_TYPE_PCI_VENDOR_TYPE |
+					 PCI_VENDOR_ID_INTEL,
+					 VFIO_REGION_SUBTYPE_INTEL_IGD_OPREGION);
+	if (!opregion) {
+		printf("No IGD opregion found\n");
+		return -1;
+	}
 
-			sig[16] = 0;
+	if (pread(device, sig, 16, opregion->info->offset) != 16) {
+		printf("failed to read signature\n");
+		return -1;
+	}
 
-			printf("IGD opregion signature: %s\n", sig);
+	sig[16] = 0;
 
-			if (pread(device, &size, 4, region->offset + 16) != 4) {
-				printf("failed to read size\n");
-				return -1;
-			}
+	printf("IGD opregion signature: %s\n", sig);
 
-			printf("IGD opregion size %dKB\n", size);
+	if (pread(device, &size, 4, opregion->info->offset + 16) != 4) {
+		printf("failed to read size\n");
+		return -1;
+	}
 
-			if (pread(device, &tmp, 4, config_offset + 0xfc) != 4) {
-				printf("failed to read config\n");
-				return -1;
-			}
+	printf("IGD opregion size %dKB\n", size);
 
-			printf("IGD opregion address: %08x\n", tmp);
+	if (pread(device, &tmp, 4, config->info->offset + 0xfc) != 4) {
+		printf("failed to read config\n");
+		return -1;
+	}
 
-			tmp = 0;
+	printf("IGD opregion address: %08x\n", tmp);
 
-			pwrite(device, &tmp, 4, config_offset + 0xfc);
-			if (pread(device, &tmp, 4, config_offset + 0xfc) != 4) {
-				printf("failed to re-read config\n");
-				return -1;
-			}
+	tmp = 0;
 
-			printf("IGD opregion virt address: %08x\n", tmp);
+	pwrite(device, &tmp, 4, config->info->offset + 0xfc);
+	if (pread(device, &tmp, 4, config->info->offset + 0xfc) != 4) {
+		printf("failed to re-read config\n");
+		return -1;
+	}
 
-			free(buf);
-		}
+	printf("IGD opregion virt address: %08x\n", tmp);
 
-		region_info.argsz = sizeof(region_info);
-	}
+	vfio_regions_free(&regions);
 
 	printf("Success\n");
 	//printf("Press any key to exit\n");
@@ -11,6 +11,7 @@
 #include <libgen.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,121 +28,222 @@
 
 #include "utils.h"
 
+#define DEFAULT_ITERATIONS 1000
+
 void usage(char *name)
 {
-	printf("usage: %s <ssss:bb:dd.f>\n", name);
+	printf("usage: %s [-n iterations] <ssss:bb:dd.f>\n", name);
+	printf("\t-n:   reads timed at the start of each mmap area and each\n"
+	       "\t      trapped hole, 0 to only map, default %d\n",
+	       DEFAULT_ITERATIONS);
+}
+
+/* Time 4-byte reads at offset, through the mapping if there is one */
+static unsigned long time_reads(int device, struct vfio_region_info *info,
+				void *map, unsigned long offset,
+				unsigned long iterations,
+				struct lat_stats *stats)
+{
+	unsigned long i, before, total = 0, nsecs;
+	uint32_t val;
+
+	for (i = 0; i < iterations; i++) {
+		before = now_nsec();
+		if (map) {
+			val = *(volatile uint32_t *)map;
+		} else if (pread(device, &val, sizeof(val),
+				 info->offset + offset) != sizeof(val)) {
+			printf("pread failed at 0x%lx: %s\n",
+			       offset, strerror(errno));
+			break;
+		}
+		nsecs = now_nsec() - before;
+		lat_stats_add(stats, nsecs);
+		total += nsecs;
+	}
+
+	(void)val;
+	return i ? total / i : 0;
+}
+
+static void time_hole(int device, struct vfio_region_info *info,
+		      unsigned long start, unsigned long end,
+		      unsigned long iterations, struct lat_stats *stats)
+{
+	printf("\t\ttrapped %lx-%lx", start, end);
+	if (iterations)
+		printf(": read %lu ns", time_reads(device, info, NULL, start,
+						   iterations, stats));
+	printf("\n");
+}
+
+/*
+ * mmap each sparse area, or the whole region without a sparse mmap
+ * capability, and compare read latency through the mappings to the
+ * holes between them which are only accessible through the trapped
+ * read/write path, eg. the MSI-X table and PBA.  Areas are expected in
+ * ascending order.
+ */
+static void map_areas(int device, struct vfio_region *region,
+		      unsigned long iterations)
+{
+	struct vfio_region_info *info = region->info;
+	struct vfio_region_sparse_mmap_area whole = { .size = info->size };
+	struct vfio_region_sparse_mmap_area *areas = &whole;
+	unsigned long prev_end = 0, mapped = 0;
+	struct lat_stats mmap_lat, trap_lat;
+	unsigned int i, nr_areas = 1;
+
+	if (region->sparse) {
+		areas = region->sparse->areas;
+		nr_areas = vfio_region_nr_areas(region);
+	}
+
+	if (lat_stats_init(&mmap_lat, nr_areas * iterations) ||
+	    lat_stats_init(&trap_lat, (nr_areas + 1) * iterations))
+		return;
+
+	for (i = 0; i < nr_areas; i++) {
+		unsigned long start = areas[i].offset;
+		unsigned long end = start + areas[i].size;
+		void *map;
+
+		if (start > prev_end)
+			time_hole(device, info, prev_end, start,
+				  iterations, &trap_lat);
+		if (end > prev_end)
+			prev_end = end;
+
+		printf("\t\tmmap    %lx-%lx", start, end);
+
+		if (!areas[i].size) {
+			printf(": empty\n");
+			continue;
+		}
+
+		map = mmap(NULL, areas[i].size, PROT_READ, MAP_SHARED,
+			   device, (off_t)(info->offset + start));
+		if (map == MAP_FAILED) {
+			printf(": mmap failed: %s\n", strerror(errno));
+			continue;
+		}
+
+		mapped += areas[i].size;
+
+		/* Don't count the fault in the first read */
+		if (iterations) {
+			mmap_touch(map, sizeof(uint32_t), sizeof(uint32_t));
+			printf(": read %lu ns", time_reads(device, info, map,
+							   start, iterations,
+							   &mmap_lat));
+		}
+		printf("\n");
+
+		munmap(map, areas[i].size);
+	}
+
+	if (prev_end < info->size)
+		time_hole(device, info, prev_end, info->size,
+			  iterations, &trap_lat);
+
+	printf("\tmmapped 0x%lx of 0x%lx bytes, %.2f%% trapped\n", mapped,
+	       (unsigned long)info->size,
+	       100.0 * (info->size - mapped) / info->size);
+
+	if (iterations) {
+		lat_stats_print("mmap read", &mmap_lat);
+		lat_stats_print("trapped read", &trap_lat);
+		if (lat_stats_avg(&mmap_lat) && trap_lat.count)
+			printf("\ttrapped reads cost %.1fx mmap reads\n",
+			       (double)lat_stats_avg(&trap_lat) /
+			       lat_stats_avg(&mmap_lat));
+	}
+
+	lat_stats_free(&mmap_lat);
+	lat_stats_free(&trap_lat);
 }
 
 int main(int argc, char **argv)
 {
 	const char *devname;
 	int container, device;
-	int i;
-	int ret;
-	struct vfio_device_info device_info = {	.argsz = sizeof(device_info) };
-	struct vfio_region_info region_info = { .argsz = sizeof(region_info) };
+	int i, j, opt;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	struct vfio_regions regions;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
 
-	if (argc < 2) {
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return -1;
 	}
 
-	devname = argv[1];
+	devname = argv[optind];
 	
 	if (vfio_device_attach(devname, &container, &device, NULL))
 		return -1;
 
-	ret = ioctl(device, VFIO_DEVICE_GET_INFO, &device_info);
-	if (ret) {
-		printf("VFIO_DEVICE_GET_INFO failed: %d (%s)\n",
-		       ret, strerror(errno));
+	if (vfio_regions_get(device, &regions))
 		return -1;
-	}
 
-	printf("Device %s supports %d regions, %d irqs\n", devname, 
-	       device_info.num_regions, device_info.num_irqs);
+	printf("Device %s supports %d regions\n", devname, regions.nr);
 
-	for (i = 0; i < device_info.num_regions; i++) {
+	for (i = 0; i < regions.nr; i++) {
+		struct vfio_region *region = vfio_region(&regions, i);
 		struct vfio_region_info *info;
 
-		info = &region_info;
 		printf("Region %d: ", i);
-		region_info.index = i;
-		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, info)) {
+		if (!region) {
 			printf("Failed to get info\n");
 			continue;
 		}
 
-		if (info->flags & VFIO_REGION_INFO_FLAG_CAPS) {
-			info = calloc(info->argsz, 1);
-			if (!info) {
-				printf("Failed to alloc larger info\n");
-				info = &region_info;
-			} else {
-				memcpy(info, &region_info, sizeof(region_info));
-				if (ioctl(device,
-					  VFIO_DEVICE_GET_REGION_INFO, info)) {
-					printf("Failed to re-get info\n");
-					continue;
-				}
-			}
-		}
-
+		info = region->info;
 		printf("size 0x%lx, offset 0x%lx, flags 0x%x\n",
 		       (unsigned long)info->size,
 		       (unsigned long)info->offset, info->flags);
-		if (0 && info->flags & VFIO_REGION_INFO_FLAG_MMAP) {
-			void *map = mmap(NULL, (size_t)region_info.size,
-					 PROT_READ, MAP_SHARED, device,
-					 (off_t)region_info.offset);
-			if (map == MAP_FAILED) {
-				printf("mmap failed\n");
-				continue;
-			}
-
-			printf("[");
-			fwrite(map, 1, region_info.size > 16 ? 16 :
-						region_info.size, stdout);
-			printf("]\n");
-			munmap(map, (size_t)region_info.size);
-		}
 
-		if (info->flags & VFIO_REGION_INFO_FLAG_CAPS) {
-			struct vfio_info_cap_header *header;
+		if (region->sparse) {
+			printf("\tsparse mmap cap, nr_areas %d\n",
+			       vfio_region_nr_areas(region));
 
-			header = (void *)info + info->cap_offset;
-
-next:
-			printf("\tCapability @%d: ID %d, version %d, next %d\n",
-			       info->cap_offset, header->id, header->version,
-			       header->next);
+			for (j = 0; j < vfio_region_nr_areas(region); j++)
+				printf("\t\t%d: %llx-%llx\n", j,
+				       region->sparse->areas[j].offset,
+				       region->sparse->areas[j].offset +
+				       region->sparse->areas[j].size);
+		}
 
-			if (header->id == VFIO_REGION_INFO_CAP_SPARSE_MMAP) {
-				struct vfio_region_info_cap_sparse_mmap *sparse;
-				int i;
+		if (region->type)
+			printf("\ttype cap, type %x, sub-type %x\n",
+			       region->type->type, region->type->subtype);
 
-				sparse = (void *)header;
+		if (region->msix_mappable)
+			printf("\tMSI-X mappable cap\n");
 
-				printf("\t\tsparse mmap cap, nr_areas %d\n",
-				       sparse->nr_areas);
+		if (region->nvlink2_ssatgt)
+			printf("\tNVLink2 SSATGT cap, tgt 0x%llx\n",
+			       region->nvlink2_ssatgt->tgt);
 
-				for (i = 0; i < sparse->nr_areas; i++)
-					printf("\t\t\t%d: %llx-%llx\n", i,
-					       sparse->areas[i].offset,
-					       sparse->areas[i].offset +
-					       sparse->areas[i].size);
-			}
+		if (region->nvlink2_lnkspd)
+			printf("\tNVLink2 LNKSPD cap, link speed %d\n",
+			       region->nvlink2_lnkspd->link_speed);
 
-			if (header->next) {
-				header = (void *)info + header->next;
-				goto next;
-			}
-		}
-
-		if (info != &region_info)
-			free(info);
+		if (vfio_region_mmappable(region) && info->size)
+			map_areas(device, region, iterations);
 	}
 
+	vfio_regions_free(&regions);
+
 	printf("Success\n");
 	//printf("Press any key to exit\n");
 	//fgetc(stdin);
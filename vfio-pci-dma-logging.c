@@ -0,0 +1,345 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define DEFAULT_SIZE_MB 1024
+#define DEFAULT_CHUNK_MB 64
+#define DEFAULT_PAGE_SIZE 4096
+#define DEFAULT_REPORTS 20
+#define TB (1ull << 40)
+
+void usage(char *name)
+{
+	printf("usage: %s [-s MB] [-c MB] [-p page size] [-n reports] "
+	       "<ssss:bb:dd.f>\n", name);
+	printf("\t-s:   IOVA range tracked and DMA mapped, default %dMB\n",
+	       DEFAULT_SIZE_MB);
+	printf("\t-c:   chunk size for chunked reports and mappings, "
+	       "default %dMB\n", DEFAULT_CHUNK_MB);
+	printf("\t-p:   device logging page size, default %d\n",
+	       DEFAULT_PAGE_SIZE);
+	printf("\t-n:   reports per mode, default %d\n", DEFAULT_REPORTS);
+}
+
+/*
+ * The range is mapped through the type1 container as chunk sized mappings,
+ * type1 only reports bitmaps for IOVA ranges made up of whole mappings, so
+ * the same chunks can be harvested from either side.  The device side
+ * doesn't need the mappings, but tracks the same range a VMM would.
+ */
+struct range {
+	int container;
+	int device;
+	unsigned long size;
+	unsigned long chunk;
+	unsigned long page_size;
+	unsigned long reports;
+	uint64_t *bitmap;
+};
+
+static int device_logging_start(int device, unsigned long size,
+				unsigned long page_size)
+{
+	uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_device_feature) +
+			sizeof(struct vfio_device_feature_dma_logging_control),
+			sizeof(uint64_t))] = {};
+	struct vfio_device_feature *feature = (struct vfio_device_feature *)buf;
+	struct vfio_device_feature_dma_logging_control *control =
+		(struct vfio_device_feature_dma_logging_control *)feature->data;
+	struct vfio_device_feature_dma_logging_range range = {
+		.iova = 0,
+		.length = size,
+	};
+
+	feature->argsz = sizeof(buf);
+	feature->flags = VFIO_DEVICE_FEATURE_SET |
+			 VFIO_DEVICE_FEATURE_DMA_LOGGING_START;
+	control->page_size = page_size;
+	control->num_ranges = 1;
+	control->ranges = (uintptr_t)&range;
+
+	return ioctl(device, VFIO_DEVICE_FEATURE, feature) ? -errno : 0;
+}
+
+static void device_logging_stop(int device)
+{
+	struct vfio_device_feature feature = {
+		.argsz = sizeof(feature),
+		.flags = VFIO_DEVICE_FEATURE_SET |
+			 VFIO_DEVICE_FEATURE_DMA_LOGGING_STOP,
+	};
+
+	ioctl(device, VFIO_DEVICE_FEATURE, &feature);
+}
+
+static int device_report(struct range *r, unsigned long iova,
+			 unsigned long length)
+{
+	uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_device_feature) +
+			sizeof(struct vfio_device_feature_dma_logging_report),
+			sizeof(uint64_t))] = {};
+	struct vfio_device_feature *feature = (struct vfio_device_feature *)buf;
+	struct vfio_device_feature_dma_logging_report *report =
+		(struct vfio_device_feature_dma_logging_report *)feature->data;
+
+	feature->argsz = sizeof(buf);
+	feature->flags = VFIO_DEVICE_FEATURE_GET |
+			 VFIO_DEVICE_FEATURE_DMA_LOGGING_REPORT;
+	report->iova = iova;
+	report->length = length;
+	report->page_size = r->page_size;
+	report->bitmap = (uintptr_t)r->bitmap;
+
+	return ioctl(r->device, VFIO_DEVICE_FEATURE, feature) ? -errno : 0;
+}
+
+static int iommu_dirty_pages(int container, uint32_t flags)
+{
+	struct vfio_iommu_type1_dirty_bitmap dirty = {
+		.argsz = sizeof(dirty),
+		.flags = flags,
+	};
+
+	return ioctl(container, VFIO_IOMMU_DIRTY_PAGES, &dirty) ? -errno : 0;
+}
+
+static int iommu_report(struct range *r, unsigned long iova,
+			unsigned long length)
+{
+	uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_iommu_type1_dirty_bitmap) +
+			sizeof(struct vfio_iommu_type1_dirty_bitmap_get),
+			sizeof(uint64_t))] = {};
+	struct vfio_iommu_type1_dirty_bitmap *dirty =
+		(struct vfio_iommu_type1_dirty_bitmap *)buf;
+	struct vfio_iommu_type1_dirty_bitmap_get *get =
+		(struct vfio_iommu_type1_dirty_bitmap_get *)dirty->data;
+
+	dirty->argsz = sizeof(buf);
+	dirty->flags = VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP;
+	get->iova = iova;
+	get->size = length;
+	get->bitmap.pgsize = r->page_size;
+	get->bitmap.size = DIV_ROUND_UP(length / r->page_size, 64) *
+			   sizeof(uint64_t);
+	get->bitmap.data = (__u64 *)r->bitmap;
+
+	return ioctl(r->container, VFIO_IOMMU_DIRTY_PAGES, dirty) ? -errno : 0;
+}
+
+/*
+ * Harvest the whole range in one report, then as a sweep of chunk sized
+ * reports.  Bitmap throughput is bytes of bitmap returned per second, the
+ * per TB overhead scales the sweep time to 1TB of guest memory tracked.
+ */
+static void harvest(struct range *r, const char *what,
+		    int (*report)(struct range *, unsigned long, unsigned long))
+{
+	unsigned long bitmap_bytes = DIV_ROUND_UP(r->size / r->page_size, 64) *
+				     sizeof(uint64_t);
+	struct lat_stats whole, chunked;
+	unsigned long i, iova, before, nsecs;
+	char name[64];
+	int ret;
+
+	lat_stats_init(&whole, r->reports);
+	lat_stats_init(&chunked, r->reports);
+
+	for (i = 0; i < r->reports; i++) {
+		before = now_nsec();
+		ret = report(r, 0, r->size);
+		nsecs = now_nsec() - before;
+		if (ret) {
+			printf("\t%s whole range report failed: %s\n",
+			       what, strerror(-ret));
+			break;
+		}
+		lat_stats_add(&whole, nsecs);
+	}
+
+	for (i = 0; i < r->reports; i++) {
+		before = now_nsec();
+		for (iova = 0; iova < r->size; iova += r->chunk) {
+			ret = report(r, iova, r->chunk);
+			if (ret)
+				break;
+		}
+		nsecs = now_nsec() - before;
+		if (ret) {
+			printf("\t%s chunked report failed: %s\n",
+			       what, strerror(-ret));
+			break;
+		}
+		lat_stats_add(&chunked, nsecs);
+	}
+
+	printf("%s, %luK pages, %lu bitmap bytes:\n", what,
+	       r->page_size / 1024, bitmap_bytes);
+
+	snprintf(name, sizeof(name), "whole %luMB", r->size >> 20);
+	lat_stats_print(name, &whole);
+	snprintf(name, sizeof(name), "%lu x %luMB",
+		 r->size / r->chunk, r->chunk >> 20);
+	lat_stats_print(name, &chunked);
+
+	if (whole.count)
+		printf("\twhole:   %.1f MB/s bitmap, %.3fms per TB tracked\n",
+		       (double)bitmap_bytes * NSEC_PER_SEC /
+		       lat_stats_avg(&whole) / (1024 * 1024),
+		       (double)lat_stats_avg(&whole) * TB / r->size / 1000000);
+	if (chunked.count)
+		printf("\tchunked: %.1f MB/s bitmap, %.3fms per TB tracked\n",
+		       (double)bitmap_bytes * NSEC_PER_SEC /
+		       lat_stats_avg(&chunked) / (1024 * 1024),
+		       (double)lat_stats_avg(&chunked) * TB / r->size / 1000000);
+	fflush(stdout);
+
+	lat_stats_free(&whole);
+	lat_stats_free(&chunked);
+}
+
+static int map_range(struct range *r, void *mem)
+{
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+		.size = r->chunk,
+	};
+	unsigned long iova;
+
+	for (iova = 0; iova < r->size; iova += r->chunk) {
+		dma_map.vaddr = (uintptr_t)mem + iova;
+		dma_map.iova = iova;
+
+		if (ioctl(r->container, VFIO_IOMMU_MAP_DMA, &dma_map)) {
+			printf("Failed to map IOVA 0x%lx: %s\n",
+			       iova, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct vfio_iommu_type1_info iommu_info = {
+		.argsz = sizeof(iommu_info)
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+	};
+	struct range r = {
+		.size = (unsigned long)DEFAULT_SIZE_MB << 20,
+		.chunk = (unsigned long)DEFAULT_CHUNK_MB << 20,
+		.page_size = DEFAULT_PAGE_SIZE,
+		.reports = DEFAULT_REPORTS,
+	};
+	unsigned long device_page_size;
+	void *mem;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "s:c:p:n:")) != -1) {
+		switch (opt) {
+		case 's':
+			r.size = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'c':
+			r.chunk = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'p':
+			r.page_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			r.reports = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !r.size || !r.chunk || r.size % r.chunk ||
+	    !r.reports || r.page_size < 4096 ||
+	    (r.page_size & (r.page_size - 1)) || r.chunk % r.page_size) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (vfio_device_attach(argv[optind], &r.container, &r.device, NULL))
+		return -1;
+
+	/* Sized for the smallest page size either side uses */
+	r.bitmap = calloc(DIV_ROUND_UP(r.size / 4096, 64), sizeof(uint64_t));
+	if (!r.bitmap) {
+		printf("Failed to alloc bitmap\n");
+		return -1;
+	}
+
+	mem = mmap(NULL, r.size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		printf("Failed to mmap %luMB: %s\n", r.size >> 20,
+		       strerror(errno));
+		return -1;
+	}
+
+	if (map_range(&r, mem))
+		return -1;
+
+	ret = device_logging_start(r.device, r.size, r.page_size);
+	if (ret) {
+		printf("Device DMA logging: %s\n", ret == -ENOTTY ?
+		       "not supported" : strerror(-ret));
+	} else {
+		harvest(&r, "Device DMA logging", device_report);
+		device_logging_stop(r.device);
+	}
+
+	/* type1 only reports at its smallest IOMMU page size */
+	device_page_size = r.page_size;
+	if (!ioctl(r.container, VFIO_IOMMU_GET_INFO, &iommu_info) &&
+	    iommu_info.flags & VFIO_IOMMU_INFO_PGSIZES)
+		r.page_size = iommu_info.iova_pgsizes & -iommu_info.iova_pgsizes;
+
+	/*
+	 * type1 tracks dirtiness in software from pinning, with no IOMMU
+	 * hardware involved, and reports every pinned page dirty.  This is
+	 * the cost of harvesting that bitmap, not of IOMMU dirty tracking.
+	 */
+	ret = iommu_dirty_pages(r.container, VFIO_IOMMU_DIRTY_PAGES_FLAG_START);
+	if (ret) {
+		printf("type1 software dirty tracking: %s\n", strerror(-ret));
+	} else {
+		harvest(&r, "type1 software dirty tracking", iommu_report);
+		iommu_dirty_pages(r.container,
+				  VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP);
+	}
+	r.page_size = device_page_size;
+
+	dma_unmap.size = r.size;
+	ioctl(r.container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap);
+	munmap(mem, r.size);
+	free(r.bitmap);
+
+	return 0;
+}
@@ -11,6 +11,9 @@
 #include <libgen.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,12 +35,91 @@ void usage(char *name)
 	printf("usage: %s <ssss:bb:dd.f>\n", name);
 }
 
-#define false 0
-#define true 1
+/*
+ * A hot reset needs an fd for every group with a dependent device, a
+ * multi-function card can put each function in its own group.  Opening the
+ * groups one at a time serializes the sysfs and group lookups, so the other
+ * groups are opened from a thread each and timed against a serial pass.
+ */
+struct dep_group {
+	pthread_t thread;
+	int groupid;
+	int fd;
+	int err;
+	bool viable;
+	unsigned long nsecs;
+};
+
+static void *open_group(void *arg)
+{
+	struct vfio_group_status status = { .argsz = sizeof(status) };
+	struct dep_group *g = arg;
+	char path[PATH_MAX];
+	unsigned long before = now_nsec();
+
+	snprintf(path, sizeof(path), "/dev/vfio/%d", g->groupid);
+
+	g->fd = open(path, O_RDWR);
+	if (g->fd < 0)
+		g->err = errno;
+	else if (!ioctl(g->fd, VFIO_GROUP_GET_STATUS, &status))
+		g->viable = status.flags & VFIO_GROUP_FLAGS_VIABLE;
+
+	g->nsecs = now_nsec() - before;
+	return NULL;
+}
+
+static void release_groups(struct dep_group *groups, int nr_groups)
+{
+	int i;
+
+	for (i = 0; i < nr_groups; i++) {
+		if (groups[i].fd >= 0)
+			close(groups[i].fd);
+		groups[i].fd = -1;
+	}
+}
+
+/* Returns the wall time to open every group, 0 on failure */
+static unsigned long acquire_groups(struct dep_group *groups, int nr_groups,
+				    bool concurrent)
+{
+	unsigned long before = now_nsec(), nsecs;
+	int i, ret = 0;
+
+	for (i = 0; i < nr_groups; i++) {
+		if (!concurrent)
+			open_group(&groups[i]);
+		else if (pthread_create(&groups[i].thread, NULL,
+					open_group, &groups[i])) {
+			printf("Failed to create thread\n");
+			exit(-1);
+		}
+	}
+
+	if (concurrent)
+		for (i = 0; i < nr_groups; i++)
+			pthread_join(groups[i].thread, NULL);
+
+	nsecs = now_nsec() - before;
+
+	for (i = 0; i < nr_groups; i++) {
+		if (groups[i].fd < 0) {
+			printf("Failed to open group %d: %s\n",
+			       groups[i].groupid, strerror(groups[i].err));
+			ret = -1;
+		}
+	}
+
+	return ret ? 0 : nsecs;
+}
 
 int main(int argc, char **argv)
 {
-       int i, ret, container, group, device, *pfd;
+	int i, j, ret, container, group, device, *pfd;
+	int groupid, nr_groups = 0;
+	unsigned long before, nsecs;
+	struct dep_group *groups;
 	const char *devname;
 	struct vfio_device_info device_info = {	.argsz = sizeof(device_info) };
 	struct vfio_region_info region_info = { .argsz = sizeof(region_info) };
@@ -59,41 +141,18 @@ int main(int argc, char **argv)
 	if (vfio_device_attach(devname, &container, &device, &group))
 		return -1;
 
-	reset_info = malloc(sizeof(*reset_info));
+	reset_info = vfio_pci_hot_reset_info(device);
 	if (!reset_info) {
-		printf("Failed to alloc info struct\n");
-		return -ENOMEM;
-	}
-
-	reset_info->argsz = sizeof(*reset_info);
-
-	ret = ioctl(device, VFIO_DEVICE_GET_PCI_HOT_RESET_INFO, reset_info);
-	if (ret && errno == ENODEV) {
-		printf("Device does not support hot reset\n");
-		return 0;
-	}
-	if (!ret || errno != ENOSPC) {
-		printf("Expected fail/-ENOSPC, got %d/%d\n", ret, -errno);
+		if (errno == ENODEV) {
+			printf("Device does not support hot reset\n");
+			return 0;
+		}
+		printf("Reset Info error: %s\n", strerror(errno));
 		return -1;
 	}
 
 	printf("Dependent device count: %d\n", reset_info->count);
 
-	reset_info = realloc(reset_info, sizeof(*reset_info) +
-			     (reset_info->count * sizeof(*devices)));
-	if (!reset_info) {
-		printf("Failed to re-alloc info struct\n");
-		return -ENOMEM;
-	}
-
-	reset_info->argsz = sizeof(*reset_info) +
-                             (reset_info->count * sizeof(*devices));
-	ret = ioctl(device, VFIO_DEVICE_GET_PCI_HOT_RESET_INFO, reset_info);
-	if (ret) {
-		printf("Reset Info error\n");
-		return ret;
-	}
-
 	devices = &reset_info->devices[0];
 
 	for (i = 0; i < reset_info->count; i++)
@@ -102,20 +161,71 @@ int main(int argc, char **argv)
 		       devices[i].devfn >> 3, devices[i].devfn & 7,
 		       devices[i].group_id);
 
-	printf("Attempting reset: ");
-	fflush(stdout);
+	groupid = vfio_device_get_groupid(devname);
+	if (groupid < 0)
+		return -1;
 
-	reset = malloc(sizeof(*reset) + sizeof(*pfd));
-	pfd = &reset->group_fds[0];
+	/* Our group is already open, collect the others once each */
+	groups = calloc(reset_info->count, sizeof(*groups));
+	reset = calloc(1, sizeof(*reset) +
+		       (reset_info->count + 1) * sizeof(*pfd));
+	if (!groups || !reset) {
+		printf("Failed to alloc group array\n");
+		return -ENOMEM;
+	}
 
-	*pfd = group;
+	for (i = 0; i < reset_info->count; i++) {
+		for (j = 0; j < nr_groups; j++)
+			if (groups[j].groupid == devices[i].group_id)
+				break;
+		if (j == nr_groups && devices[i].group_id != groupid)
+			groups[nr_groups++].groupid = devices[i].group_id;
+	}
 
-	reset->argsz = sizeof(*reset) + sizeof(*pfd);
-	reset->count = 1;
+	printf("Dependent groups outside %d: %d\n", groupid, nr_groups);
+
+	if (nr_groups) {
+		nsecs = acquire_groups(groups, nr_groups, false);
+		release_groups(groups, nr_groups);
+		if (nsecs)
+			printf("Serial acquisition: %.3fus\n", nsecs / 1000.0);
+
+		nsecs = acquire_groups(groups, nr_groups, true);
+		if (!nsecs) {
+			release_groups(groups, nr_groups);
+			return -1;
+		}
+		printf("Concurrent acquisition: %.3fus\n", nsecs / 1000.0);
+		for (i = 0; i < nr_groups; i++)
+			printf("\tgroup %d: %.3fus%s\n", groups[i].groupid,
+			       groups[i].nsecs / 1000.0,
+			       groups[i].viable ? "" : " (not viable)");
+	}
+
+	pfd = &reset->group_fds[0];
+	pfd[0] = group;
+	for (i = 0; i < nr_groups; i++)
+		pfd[i + 1] = groups[i].fd;
+
+	reset->argsz = sizeof(*reset) + (nr_groups + 1) * sizeof(*pfd);
+	reset->count = nr_groups + 1;
 	reset->flags = 0;
 
+	printf("Attempting reset with %d group(s): ", reset->count);
+	fflush(stdout);
+
+	before = now_nsec();
 	ret = ioctl(device, VFIO_DEVICE_PCI_HOT_RESET, reset);
-	printf("%s\n", ret ? "Failed" : "Pass");
+	nsecs = now_nsec() - before;
+	if (ret)
+		printf("Failed (%m)\n");
+	else
+		printf("Pass, %.3fus\n", nsecs / 1000.0);
+
+	release_groups(groups, nr_groups);
+	free(groups);
+	free(reset);
+	free(reset_info);
 
 	return ret;
 }
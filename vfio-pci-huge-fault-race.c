@@ -22,37 +22,100 @@
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include <pthread.h>
+#include <stdbool.h>
 
 #include <linux/ioctl.h>
 #include <linux/vfio.h>
 
 #include "utils.h"
 
+#define DEFAULT_THREADS 2
+#define DEFAULT_ITERATIONS 100000
+
 void usage(char *name)
 {
-	printf("usage: %s <ssss:bb:dd.f>\n", name);
+	printf("usage: %s [-t threads] [-n iterations] <ssss:bb:dd.f>\n", name);
+	printf("\t-t:   faulting threads per mapping, default %d\n",
+	       DEFAULT_THREADS);
+	printf("\t-n:   iterations per page size, default %d\n",
+	       DEFAULT_ITERATIONS);
 }
 
-static int go;
+/*
+ * Persistent workers.  Each iteration the main thread maps a fresh huge
+ * page sized window of the BAR and everyone meets at the ready barrier.
+ * The workers then spin until the main thread bumps the generation, so
+ * they all hit their first touch as close together as possible rather
+ * than staggered by barrier wakeups, and meet again at the done barrier
+ * before the window is unmapped.
+ */
+struct race {
+	pthread_barrier_t ready;
+	pthread_barrier_t done;
+	unsigned long generation;
+	bool quit;
+	void *map;
+	size_t pagesz;
+	int nr_threads;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	struct race *race;
+	struct lat_stats lat;
+};
 
-static void *thread_func(void *map)
+static void *thread_func(void *arg)
 {
-	volatile unsigned long *val = map;
+	struct worker *w = arg;
+	struct race *race = w->race;
+	unsigned long gen = 0, before;
+	size_t npages, off;
+
+	for (;;) {
+		pthread_barrier_wait(&race->ready);
+		if (race->quit)
+			break;
+
+		/* Spread the threads from the first to the last page */
+		npages = race->pagesz / getpagesize();
+		off = race->nr_threads > 1 ?
+		      (npages - 1) * w->id / (race->nr_threads - 1) : 0;
+
+		gen++;
+		while (__atomic_load_n(&race->generation, __ATOMIC_ACQUIRE) != gen)
+			;
 
-	do {} while (!go);
+		before = now_nsec();
+		(void)*(volatile unsigned long *)(race->map + off * getpagesize());
+		lat_stats_add(&w->lat, now_nsec() - before);
+
+		pthread_barrier_wait(&race->done);
+	}
 
-	(void)*val;
 	return NULL;
 }
 
-static void do_race(int device, struct vfio_region_info *region, size_t pagesz)
+static void do_race(int device, struct vfio_region_info *region, size_t pagesz,
+		    struct race *race, struct worker *workers,
+		    unsigned long iterations)
 {
-	int i;
+	unsigned long i, start, nsecs;
+	struct lat_stats all;
+	int t;
+
+	race->pagesz = pagesz;
+	for (t = 0; t < race->nr_threads; t++) {
+		lat_stats_free(&workers[t].lat);
+		lat_stats_init(&workers[t].lat, iterations);
+	}
 
-	for (i = 0; i < 100000;) {
-		pthread_t thread1, thread2;
+	start = now_nsec();
+
+	for (i = 0; i < iterations;) {
 		void *map;
-		
+
 		map = mmap_align(NULL, pagesz, PROT_READ, MAP_SHARED,
 						 device, (off_t)region->offset, pagesz);
 		if (map == MAP_FAILED) {
@@ -60,12 +123,11 @@ static void do_race(int device, struct vfio_region_info *region, size_t pagesz)
 			return;
 		}
 
-		go = 0;
-		pthread_create(&thread1, NULL, thread_func, map + pagesz - getpagesize());
-		pthread_create(&thread2, NULL, thread_func, map);
-		go = 1;
-		pthread_join(thread1, NULL);
-		pthread_join(thread2, NULL);
+		race->map = map;
+		pthread_barrier_wait(&race->ready);
+		__atomic_store_n(&race->generation, race->generation + 1,
+				 __ATOMIC_RELEASE);
+		pthread_barrier_wait(&race->done);
 
 		munmap(map, pagesz);
 		if (!(++i % 10000)) {
@@ -73,14 +135,31 @@ static void do_race(int device, struct vfio_region_info *region, size_t pagesz)
 			fflush(stdout);
 		}
 	}
-	printf(" [DONE]\n");
+
+	nsecs = now_nsec() - start;
+	printf(" [DONE] %.0f iterations/s\n",
+	       (double)iterations * NSEC_PER_SEC / nsecs);
+
+	if (lat_stats_init(&all, iterations * race->nr_threads))
+		return;
+
+	for (t = 0; t < race->nr_threads; t++)
+		for (i = 0; i < workers[t].lat.count; i++)
+			lat_stats_add(&all, workers[t].lat.samples[i]);
+
+	lat_stats_print("first touch", &all);
+	lat_stats_free(&all);
 }
 
 int main(int argc, char **argv)
 {
 	const char *devname;
 	int container, device;
-	int region, ret;
+	int region, ret, opt, t;
+	int nr_threads = DEFAULT_THREADS;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	struct race race = { 0 };
+	struct worker *workers;
 	struct vfio_device_info device_info = {	.argsz = sizeof(device_info) };
 	struct vfio_region_info region_info = { .argsz = sizeof(region_info) };
 	size_t *pgsize, pgsizes[] = {
@@ -90,12 +169,26 @@ int main(int argc, char **argv)
 		0
 	};
 
-	if (argc < 2) {
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if (optind != argc - 1 || nr_threads < 1 || !iterations) {
 		usage(argv[0]);
 		return -EINVAL;
 	}
 
-	devname = argv[1];
+	devname = argv[optind];
 
 	if (vfio_device_attach(devname, &container, &device, NULL))
 		return -1;
@@ -113,7 +206,28 @@ int main(int argc, char **argv)
 		return -ENODEV;
 	}
 
-	printf("Running tests, if progress dots stop or system generates errors, the test has failed\n");
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		printf("Failed to alloc workers\n");
+		return -ENOMEM;
+	}
+
+	race.nr_threads = nr_threads;
+	pthread_barrier_init(&race.ready, NULL, nr_threads + 1);
+	pthread_barrier_init(&race.done, NULL, nr_threads + 1);
+
+	for (t = 0; t < nr_threads; t++) {
+		workers[t].id = t;
+		workers[t].race = &race;
+		if (pthread_create(&workers[t].thread, NULL,
+				   thread_func, &workers[t])) {
+			printf("Failed to create thread %d\n", t);
+			return -1;
+		}
+	}
+
+	printf("Running tests with %d faulting threads, if progress dots stop or system generates errors, the test has failed\n",
+	       nr_threads);
 
 	for (pgsize = &pgsizes[0]; *pgsize; pgsize++) {
 		for (region = 0; region < VFIO_PCI_ROM_REGION_INDEX; region++) {
@@ -132,7 +246,8 @@ int main(int argc, char **argv)
 			printf("Using BAR%d (size %ldMB) for %ldMB page size test\n", region,
 					(unsigned long)region_info.size >> 20, *pgsize >> 20);
 
-			do_race(device, &region_info, *pgsize);
+			do_race(device, &region_info, *pgsize,
+				&race, workers, iterations);
 			break;
 		}
 
@@ -142,6 +257,14 @@ int main(int argc, char **argv)
 		}
 	}
 
+	race.quit = true;
+	pthread_barrier_wait(&race.ready);
+	for (t = 0; t < nr_threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		lat_stats_free(&workers[t].lat);
+	}
+	free(workers);
+
 	printf("Check dmesg, if there are any VM_FAULT_OOM messages, the test has failed\n");
 
 	return 0;
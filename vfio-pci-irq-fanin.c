@@ -0,0 +1,564 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/io_uring.h>
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define MAX_DEVICES 16
+#define MAX_VECS 4096
+#define MAX_THREADS 64
+#define EPOLL_BATCH 64
+#define DEFAULT_SECS 2
+
+/* Added in v6.7, not yet in all uapi headers */
+#define IO_URING_OP_READ_MULTISHOT 49
+
+void usage(char *name)
+{
+	printf("usage: %s [-v vectors] [-c consumers] [-t triggers] [-d secs] "
+	       "<ssss:bb:dd.f> [<ssss:bb:dd.f> ...]\n", name);
+	printf("\t-v:   MSI-X, or MSI, vectors per device, default all\n");
+	printf("\t-c:   epoll and io_uring consumer threads, default 1\n");
+	printf("\t-t:   trigger threads, default 1\n");
+	printf("\t-d:   seconds per consumer model, default %d\n",
+	       DEFAULT_SECS);
+	printf("\tDevices must be in separate IOMMU groups\n");
+}
+
+/*
+ * Each vector is only re-triggered once the consumer has seen its last
+ * interrupt, so eventfd counts never coalesce and the stamp taken before
+ * the trigger is the one the consumer measures against.
+ */
+struct vec {
+	int device;
+	unsigned int index;
+	unsigned int vector;
+	int efd;
+	unsigned long stamp;
+	int pending;
+};
+
+enum model { MODEL_THREADS, MODEL_EPOLL, MODEL_IO_URING, NR_MODELS };
+
+static const char *model_names[] = { "thread/fd", "epoll", "io_uring" };
+
+static struct vec vecs[MAX_VECS];
+static unsigned int nr_vecs;
+static volatile bool stop;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int nr;
+	unsigned long count;
+	struct lat_stats lat;
+};
+
+static void consume(struct worker *w, struct vec *vec)
+{
+	unsigned long now = now_nsec();
+
+	if (stop)
+		return;
+
+	lat_stats_add(&w->lat,
+		      now - __atomic_load_n(&vec->stamp, __ATOMIC_ACQUIRE));
+	w->count++;
+	__atomic_store_n(&vec->pending, 0, __ATOMIC_RELEASE);
+}
+
+static void *trigger_func(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int i;
+
+	while (!stop) {
+		for (i = w->id; i < nr_vecs; i += w->nr) {
+			struct vec *vec = &vecs[i];
+
+			if (__atomic_load_n(&vec->pending, __ATOMIC_ACQUIRE))
+				continue;
+
+			vec->pending = 1;
+			__atomic_store_n(&vec->stamp, now_nsec(),
+					 __ATOMIC_RELEASE);
+			if (vfio_irq_trigger(vec->device, vec->index,
+					     vec->vector, 1))
+				printf("Trigger failed: %m\n");
+			w->count++;
+		}
+	}
+
+	return NULL;
+}
+
+/* One blocking reader per vector */
+static void *thread_func(void *arg)
+{
+	struct worker *w = arg;
+	struct vec *vec = &vecs[w->id];
+	uint64_t val;
+
+	while (!stop) {
+		if (read(vec->efd, &val, sizeof(val)) == sizeof(val))
+			consume(w, vec);
+	}
+
+	return NULL;
+}
+
+/* Every nr'th vector on one epoll, harvesting up to EPOLL_BATCH per wait */
+static void *epoll_func(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event events[EPOLL_BATCH];
+	unsigned int i;
+	uint64_t val;
+	int epfd, n;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		printf("epoll_create1 failed: %m\n");
+		return NULL;
+	}
+
+	for (i = w->id; i < nr_vecs; i += w->nr) {
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.u32 = i,
+		};
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, vecs[i].efd, &event))
+			printf("epoll_ctl failed: %m\n");
+	}
+
+	while (!stop) {
+		n = epoll_wait(epfd, events, EPOLL_BATCH, -1);
+
+		for (i = 0; i < n; i++) {
+			struct vec *vec = &vecs[events[i].data.u32];
+
+			if (read(vec->efd, &val, sizeof(val)) == sizeof(val))
+				consume(w, vec);
+		}
+	}
+
+	close(epfd);
+	return NULL;
+}
+
+/*
+ * Minimal io_uring, no liburing.  Every nr'th vector gets a multishot read
+ * selecting 8-byte buffers from a provided buffer ring, each completion
+ * hands back a buffer id which is recycled to the ring once consumed.
+ */
+struct uring {
+	int fd;
+	void *sq, *cq;
+	size_t sq_len, cq_len, sqes_len, br_len;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;
+	unsigned int nr_bufs;
+	uint64_t *bufs;
+	unsigned int to_submit;
+};
+
+static int uring_setup(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = entries * 4,
+	};
+	struct io_uring_buf_reg reg = { 0 };
+	void *sq, *cq;
+	unsigned int i;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->sq = ring->cq = ring->sqes = MAP_FAILED;
+	ring->br = MAP_FAILED;
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(*ring->cqes);
+	ring->sqes_len = p.sq_entries * sizeof(*ring->sqes);
+
+	sq = ring->sq = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	cq = ring->cq = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+		return -errno;
+
+	ring->sq_tail = sq + p.sq_off.tail;
+	ring->sq_mask = sq + p.sq_off.ring_mask;
+	ring->sq_array = sq + p.sq_off.array;
+	ring->cq_head = cq + p.cq_off.head;
+	ring->cq_tail = cq + p.cq_off.tail;
+	ring->cq_mask = cq + p.cq_off.ring_mask;
+	ring->cqes = cq + p.cq_off.cqes;
+
+	/* Buffer rings must be a power of two */
+	for (ring->nr_bufs = 8; ring->nr_bufs < entries * 2; ring->nr_bufs <<= 1)
+		;
+
+	ring->br_len = ring->nr_bufs * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = calloc(ring->nr_bufs, sizeof(*ring->bufs));
+	if (ring->br == MAP_FAILED || !ring->bufs)
+		return -ENOMEM;
+
+	reg.ring_addr = (unsigned long)ring->br;
+	reg.ring_entries = ring->nr_bufs;
+	reg.bgid = 0;
+
+	if (syscall(__NR_io_uring_register, ring->fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1))
+		return -errno;
+
+	for (i = 0; i < ring->nr_bufs; i++) {
+		ring->br->bufs[i].addr = (unsigned long)&ring->bufs[i];
+		ring->br->bufs[i].len = sizeof(uint64_t);
+		ring->br->bufs[i].bid = i;
+	}
+	__atomic_store_n(&ring->br->tail, ring->nr_bufs, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void uring_recycle(struct uring *ring, unsigned int bid)
+{
+	unsigned short tail = ring->br->tail;
+	struct io_uring_buf *buf = &ring->br->bufs[tail & (ring->nr_bufs - 1)];
+
+	buf->addr = (unsigned long)&ring->bufs[bid];
+	buf->len = sizeof(uint64_t);
+	buf->bid = bid;
+	__atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_read_multishot(struct uring *ring, unsigned int i)
+{
+	unsigned int tail = *ring->sq_tail, idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IO_URING_OP_READ_MULTISHOT;
+	sqe->fd = vecs[i].efd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = i;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+static void uring_free(struct uring *ring)
+{
+	if (ring->sq != MAP_FAILED)
+		munmap(ring->sq, ring->sq_len);
+	if (ring->cq != MAP_FAILED)
+		munmap(ring->cq, ring->cq_len);
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->br != MAP_FAILED)
+		munmap(ring->br, ring->br_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring->bufs);
+}
+
+static void *io_uring_func(void *arg)
+{
+	struct worker *w = arg;
+	struct uring ring;
+	unsigned int i, head, entries = 0;
+	int ret;
+
+	for (i = w->id; i < nr_vecs; i += w->nr)
+		entries++;
+
+	ret = uring_setup(&ring, entries);
+	if (ret) {
+		printf("io_uring setup failed: %s\n", strerror(-ret));
+		uring_free(&ring);
+		return NULL;
+	}
+
+	for (i = w->id; i < nr_vecs; i += w->nr)
+		uring_read_multishot(&ring, i);
+
+	while (!stop) {
+		ret = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("io_uring_enter failed: %m\n");
+			break;
+		}
+		ring.to_submit = 0;
+
+		head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			struct vec *vec = &vecs[cqe->user_data];
+
+			if (cqe->res > 0 && cqe->flags & IORING_CQE_F_BUFFER) {
+				consume(w, vec);
+				uring_recycle(&ring,
+					      cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			} else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+				printf("Multishot read failed: %s\n",
+				       strerror(-cqe->res));
+				stop = true;
+				break;
+			}
+
+			/* Re-arm if the kernel ended the multishot */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_read_multishot(&ring, cqe->user_data);
+
+			head++;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring_free(&ring);
+	return NULL;
+}
+
+static void *(*model_funcs[])(void *) = {
+	thread_func, epoll_func, io_uring_func
+};
+
+static int run(enum model model, int nr_consumers, int nr_triggers,
+	       unsigned int secs)
+{
+	struct worker *consumers, triggers[MAX_THREADS];
+	unsigned long before = 0, nsecs, count = 0;
+	struct lat_stats lat;
+	unsigned int i, j;
+	int c = 0, t = 0;
+	uint64_t val = 1;
+	int32_t efds[MAX_VECS];
+	int ret = 0;
+
+	/* Every consumer needs a vector to be woken through at the end */
+	if (model == MODEL_THREADS || nr_consumers > nr_vecs)
+		nr_consumers = nr_vecs;
+
+	for (i = 0; i < nr_vecs; i++) {
+		vecs[i].efd = eventfd(0, EFD_CLOEXEC |
+				      (model == MODEL_THREADS ? 0 : EFD_NONBLOCK));
+		vecs[i].pending = 0;
+		if (vecs[i].efd < 0) {
+			printf("Failed to create eventfd: %m\n");
+			return -1;
+		}
+	}
+
+	/* Wire each device's run of vectors with one SET_IRQS */
+	for (i = 0; i < nr_vecs; i = j) {
+		for (j = i; j < nr_vecs && vecs[j].device == vecs[i].device; j++)
+			efds[j] = vecs[j].efd;
+
+		ret = vfio_irq_set_eventfds(vecs[i].device, vecs[i].index,
+					    0, j - i, &efds[i]);
+		if (ret) {
+			printf("Failed to enable %u vectors: %s\n",
+			       j - i, strerror(-ret));
+			goto out_close;
+		}
+	}
+
+	consumers = calloc(nr_consumers, sizeof(*consumers));
+	if (!consumers) {
+		ret = -ENOMEM;
+		goto out_disable;
+	}
+
+	stop = false;
+
+	for (c = 0; c < nr_consumers; c++) {
+		consumers[c].id = c;
+		consumers[c].nr = nr_consumers;
+		if (lat_stats_init(&consumers[c].lat, 0))
+			goto out_stop;
+		if (pthread_create(&consumers[c].thread, NULL,
+				   model_funcs[model], &consumers[c])) {
+			printf("Failed to create consumer thread\n");
+			lat_stats_free(&consumers[c].lat);
+			goto out_stop;
+		}
+	}
+
+	before = now_nsec();
+
+	for (t = 0; t < nr_triggers; t++) {
+		triggers[t] = (struct worker){ .id = t, .nr = nr_triggers };
+		if (pthread_create(&triggers[t].thread, NULL,
+				   trigger_func, &triggers[t])) {
+			printf("Failed to create trigger thread\n");
+			goto out_stop;
+		}
+	}
+
+	sleep(secs);
+
+out_stop:
+	stop = true;
+
+	for (i = 0; i < t; i++)
+		pthread_join(triggers[i].thread, NULL);
+
+	nsecs = now_nsec() - before;
+
+	/* Kick any consumers still waiting */
+	for (i = 0; i < nr_vecs; i++)
+		if (write(vecs[i].efd, &val, sizeof(val)) != sizeof(val))
+			printf("Failed to wake consumer: %m\n");
+
+	/* Only report a run where every worker started */
+	if (t < nr_triggers || lat_stats_init(&lat, 0))
+		ret = -1;
+
+	for (i = 0; i < c; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		count += consumers[i].count;
+		for (j = 0; !ret && j < consumers[i].lat.count; j++)
+			lat_stats_add(&lat, consumers[i].lat.samples[j]);
+		lat_stats_free(&consumers[i].lat);
+	}
+
+	if (!ret) {
+		printf("%-9s %4u vectors, %4d consumers: %10.0f irqs/s\n",
+		       model_names[model], nr_vecs, nr_consumers,
+		       (double)count * NSEC_PER_SEC / nsecs);
+		lat_stats_print("wakeup", &lat);
+		fflush(stdout);
+		lat_stats_free(&lat);
+	}
+
+	free(consumers);
+
+out_disable:
+	for (i = 0; i < nr_vecs; i++)
+		if (!i || vecs[i].device != vecs[i - 1].device)
+			vfio_irq_disable(vecs[i].device, vecs[i].index);
+out_close:
+	for (i = 0; i < nr_vecs; i++)
+		close(vecs[i].efd);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int container, device;
+	int opt, d, nr_consumers = 1, nr_triggers = 1;
+	unsigned int v, max_vecs = 0, secs = DEFAULT_SECS;
+	struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+	enum model model;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "v:c:t:d:")) != -1) {
+		switch (opt) {
+		case 'v':
+			max_vecs = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			nr_consumers = atoi(optarg);
+			break;
+		case 't':
+			nr_triggers = atoi(optarg);
+			break;
+		case 'd':
+			secs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind == argc || argc - optind > MAX_DEVICES ||
+	    nr_consumers < 1 || nr_consumers > MAX_THREADS ||
+	    nr_triggers < 1 || nr_triggers > MAX_THREADS || !secs) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (d = optind; d < argc; d++) {
+		if (vfio_device_attach(argv[d], &container, &device, NULL))
+			return -1;
+
+		irq_info.index = VFIO_PCI_MSIX_IRQ_INDEX;
+		if (ioctl(device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info) ||
+		    !irq_info.count) {
+			irq_info.index = VFIO_PCI_MSI_IRQ_INDEX;
+			if (ioctl(device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info) ||
+			    !irq_info.count) {
+				printf("%s: no MSI-X or MSI support\n", argv[d]);
+				return -1;
+			}
+		}
+
+		if (max_vecs && irq_info.count > max_vecs)
+			irq_info.count = max_vecs;
+
+		printf("%s: using %u %s vectors\n", argv[d], irq_info.count,
+		       irq_info.index == VFIO_PCI_MSIX_IRQ_INDEX ?
+		       "MSI-X" : "MSI");
+
+		for (v = 0; v < irq_info.count && nr_vecs < MAX_VECS; v++) {
+			vecs[nr_vecs].device = device;
+			vecs[nr_vecs].index = irq_info.index;
+			vecs[nr_vecs].vector = v;
+			nr_vecs++;
+		}
+	}
+
+	for (model = MODEL_THREADS; model < NR_MODELS; model++)
+		if (run(model, nr_consumers, nr_triggers, secs))
+			ret = -1;
+
+	return ret;
+}
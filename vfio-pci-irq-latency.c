@@ -0,0 +1,309 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define DEFAULT_ITERATIONS 10000
+#define MAX_CPUS 64
+
+void usage(char *name)
+{
+	printf("usage: %s [-n iterations] [-c cpu,cpu,...] <ssss:bb:dd.f>\n",
+	       name);
+	printf("\t-n:   interrupts per configuration, default %d\n",
+	       DEFAULT_ITERATIONS);
+	printf("\t-c:   CPUs for the trigger x consumer matrix, default 0,1\n");
+}
+
+enum mode { MODE_BLOCKING, MODE_EPOLL, MODE_BUSY_POLL, NR_MODES };
+
+static const char *mode_names[] = { "blocking", "epoll", "busy-poll" };
+
+/*
+ * The trigger thread stamps the time and fires the vector with a
+ * VFIO_IRQ_SET_DATA_NONE trigger, the consumer wakes from the eventfd and
+ * records the latency from the stamp, then bumps seq so the trigger fires
+ * the next one.  Only one interrupt is ever in flight.  A consumer that
+ * can't wait on the eventfd sets failed, which also releases the trigger.
+ */
+struct irq_test {
+	int efd;
+	enum mode mode;
+	int consumer_cpu;
+	unsigned long iterations;
+	unsigned long stamp;
+	unsigned long seq;
+	bool failed;
+	pthread_barrier_t barrier;
+	struct lat_stats lat;
+};
+
+static int pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *consumer_func(void *arg)
+{
+	struct irq_test *test = arg;
+	struct epoll_event event = { .events = EPOLLIN };
+	unsigned long i, now;
+	uint64_t val;
+	int epfd = -1;
+
+	if (pin_cpu(test->consumer_cpu))
+		printf("Failed to pin consumer to CPU %d\n", test->consumer_cpu);
+
+	if (test->mode == MODE_EPOLL) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0 ||
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, test->efd, &event)) {
+			printf("epoll setup failed: %m\n");
+			__atomic_store_n(&test->failed, true, __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_barrier_wait(&test->barrier);
+
+	if (__atomic_load_n(&test->failed, __ATOMIC_ACQUIRE))
+		goto out;
+
+	for (i = 0; i < test->iterations; i++) {
+		switch (test->mode) {
+		case MODE_BLOCKING:
+			while (read(test->efd, &val, sizeof(val)) != sizeof(val))
+				;
+			break;
+		case MODE_EPOLL:
+			while (epoll_wait(epfd, &event, 1, -1) != 1) {
+				if (errno != EINTR) {
+					printf("epoll_wait failed: %m\n");
+					__atomic_store_n(&test->failed, true,
+							 __ATOMIC_RELEASE);
+					goto out;
+				}
+			}
+			while (read(test->efd, &val, sizeof(val)) != sizeof(val))
+				;
+			break;
+		case MODE_BUSY_POLL:
+			while (read(test->efd, &val, sizeof(val)) != sizeof(val))
+				;
+			break;
+		default:
+			break;
+		}
+
+		now = now_nsec();
+		lat_stats_add(&test->lat,
+			      now - __atomic_load_n(&test->stamp, __ATOMIC_ACQUIRE));
+		__atomic_store_n(&test->seq, i + 1, __ATOMIC_RELEASE);
+	}
+
+out:
+	if (epfd >= 0)
+		close(epfd);
+
+	return NULL;
+}
+
+static int run(int device, unsigned int index, enum mode mode,
+	       int trigger_cpu, int consumer_cpu, unsigned long iterations)
+{
+	struct irq_test test = {
+		.mode = mode,
+		.consumer_cpu = consumer_cpu,
+		.iterations = iterations,
+	};
+	struct lat_stats trigger;
+	pthread_t consumer;
+	char name[32];
+	unsigned long i, before;
+	int32_t fd;
+	int ret;
+
+	test.efd = fd = eventfd(0, EFD_CLOEXEC |
+				(mode == MODE_BLOCKING ? 0 : EFD_NONBLOCK));
+	if (test.efd < 0) {
+		printf("Failed to create eventfd: %m\n");
+		return -1;
+	}
+
+	ret = vfio_irq_set_eventfds(device, index, 0, 1, &fd);
+	if (ret) {
+		printf("Failed to enable vector: %s\n", strerror(-ret));
+		close(test.efd);
+		return ret;
+	}
+
+	lat_stats_init(&test.lat, iterations);
+	lat_stats_init(&trigger, iterations);
+	pthread_barrier_init(&test.barrier, NULL, 2);
+
+	if (pin_cpu(trigger_cpu))
+		printf("Failed to pin trigger to CPU %d\n", trigger_cpu);
+
+	if (pthread_create(&consumer, NULL, consumer_func, &test)) {
+		printf("Failed to create consumer thread\n");
+		ret = -1;
+		goto out;
+	}
+
+	pthread_barrier_wait(&test.barrier);
+
+	for (i = 0; i < iterations &&
+	     !__atomic_load_n(&test.failed, __ATOMIC_ACQUIRE); i++) {
+		before = now_nsec();
+		__atomic_store_n(&test.stamp, before, __ATOMIC_RELEASE);
+
+		ret = vfio_irq_trigger(device, index, 0, 1);
+		lat_stats_add(&trigger, now_nsec() - before);
+		if (ret) {
+			printf("Trigger failed: %s\n", strerror(-ret));
+			pthread_cancel(consumer);
+			break;
+		}
+
+		/* Sharing a CPU, let the consumer run */
+		while (__atomic_load_n(&test.seq, __ATOMIC_ACQUIRE) != i + 1 &&
+		       !__atomic_load_n(&test.failed, __ATOMIC_ACQUIRE))
+			if (trigger_cpu == consumer_cpu)
+				sched_yield();
+	}
+
+	pthread_join(consumer, NULL);
+
+	if (test.failed)
+		ret = -1;
+
+	if (!ret) {
+		snprintf(name, sizeof(name), "%s %d->%d wakeup",
+			 mode_names[mode], trigger_cpu, consumer_cpu);
+		lat_stats_print(name, &test.lat);
+		lat_stats_print("trigger ioctl", &trigger);
+		fflush(stdout);
+	}
+
+out:
+	pthread_barrier_destroy(&test.barrier);
+	lat_stats_free(&test.lat);
+	lat_stats_free(&trigger);
+	vfio_irq_disable(device, index);
+	close(test.efd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	int container, device;
+	int opt, t, c, nr_cpus = 0, cpus[MAX_CPUS];
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+	unsigned int index;
+	enum mode mode;
+	int failed = 0;
+	char *tok;
+	static const char *index_names[] = {
+		[VFIO_PCI_INTX_IRQ_INDEX] = "INTx",
+		[VFIO_PCI_MSI_IRQ_INDEX] = "MSI",
+		[VFIO_PCI_MSIX_IRQ_INDEX] = "MSI-X",
+	};
+
+	while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			for (tok = strtok(optarg, ","); tok && nr_cpus < MAX_CPUS;
+			     tok = strtok(NULL, ","))
+				cpus[nr_cpus++] = atoi(tok);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !iterations) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (!nr_cpus) {
+		cpus[nr_cpus++] = 0;
+		if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+			cpus[nr_cpus++] = 1;
+	}
+
+	devname = argv[optind];
+
+	if (vfio_device_attach(devname, &container, &device, NULL))
+		return -1;
+
+	for (index = VFIO_PCI_INTX_IRQ_INDEX;
+	     index <= VFIO_PCI_MSIX_IRQ_INDEX; index++) {
+		irq_info.index = index;
+		if (ioctl(device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info) ||
+		    !irq_info.count ||
+		    !(irq_info.flags & VFIO_IRQ_INFO_EVENTFD)) {
+			printf("%s: not supported\n", index_names[index]);
+			continue;
+		}
+
+		printf("%s: %u vectors, %lu interrupts per configuration\n",
+		       index_names[index], irq_info.count, iterations);
+
+		for (mode = MODE_BLOCKING; mode < NR_MODES; mode++) {
+			for (t = 0; t < nr_cpus; t++) {
+				for (c = 0; c < nr_cpus; c++) {
+					/* Two spinners on one CPU only measure the scheduler */
+					if (mode == MODE_BUSY_POLL &&
+					    cpus[t] == cpus[c])
+						continue;
+
+					if (run(device, index, mode, cpus[t],
+						cpus[c], iterations)) {
+						failed = 1;
+						goto next_mode;
+					}
+				}
+			}
+next_mode:
+			;
+		}
+	}
+
+	return failed ? -1 : 0;
+}
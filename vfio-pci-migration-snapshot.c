@@ -0,0 +1,453 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define DEFAULT_BUF_SIZE (8 << 20)
+#define DIRECT_ALIGN 4096
+#define MAX_DEVICES 16
+
+void usage(char *name)
+{
+	printf("usage: %s [-d dir] [-b KB] [-m method] [-k] "
+	       "<ssss:bb:dd.f|mdev UUID> ...\n", name);
+	printf("\t-d:   snapshot directory, default current directory\n");
+	printf("\t-b:   transfer size, multiple of 4KB, default %dKB\n",
+	       DEFAULT_BUF_SIZE / 1024);
+	printf("\t-m:   splice or direct, default the first the data_fd\n"
+	       "\t      and filesystem allow in that order\n");
+	printf("\t-k:   keep the snapshot files\n");
+}
+
+/*
+ * Ways to move the stream between the data_fd and the snapshot file, from
+ * cheapest down.  splice avoids the user copy but needs the migration
+ * driver's data_fd to support it, the O_DIRECT fallback works with any
+ * data_fd and still keeps the page cache out of the way on the file side.
+ * copy_file_range isn't an option, it requires regular files both ends.
+ */
+enum method { METHOD_SPLICE, METHOD_DIRECT, NR_METHODS };
+
+static const char *method_names[] = { "splice", "direct" };
+
+struct snapshot {
+	const char *name;
+	int device;
+	char path[PATH_MAX];
+	size_t bufsize;
+	int force_method;
+	enum method method;
+	bool direct;
+	pthread_t thread;
+	size_t bytes;
+	unsigned long save_nsecs;
+	unsigned long restore_nsecs;
+	int ret;
+};
+
+/* Bytes moved from in to out are counted in s->bytes */
+static int stream_splice(struct snapshot *s, int in, int out)
+{
+	ssize_t len, ret;
+	int pipefd[2];
+
+	if (pipe(pipefd))
+		return -errno;
+
+	/* Best effort, a full size pipe moves a transfer per splice pair */
+	fcntl(pipefd[1], F_SETPIPE_SZ, s->bufsize);
+
+	for (;;) {
+		len = splice(in, NULL, pipefd[1], NULL, s->bufsize,
+			     SPLICE_F_MOVE);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			goto out;
+		}
+		if (!len) {
+			ret = 0;
+			goto out;
+		}
+
+		while (len) {
+			ret = splice(pipefd[0], NULL, out, NULL, len,
+				     SPLICE_F_MOVE);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -errno;
+				goto out;
+			}
+			len -= ret;
+			s->bytes += ret;
+		}
+	}
+
+out:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return ret;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Buffer a full transfer before each write so O_DIRECT writes stay aligned,
+ * the unaligned tail of the stream is written with O_DIRECT cleared.
+ * Filesystems without O_DIRECT support fall back to buffered writes.
+ */
+static int stream_direct(struct snapshot *s, int in, int out, bool to_file)
+{
+	int file = to_file ? out : in, flags, ret = 0;
+	size_t fill = 0, aligned;
+	ssize_t len;
+	void *buf;
+
+	if (posix_memalign(&buf, DIRECT_ALIGN, s->bufsize))
+		return -ENOMEM;
+
+	flags = fcntl(file, F_GETFL);
+	s->direct = !fcntl(file, F_SETFL, flags | O_DIRECT);
+
+	for (;;) {
+		len = read(in, buf + fill, s->bufsize - fill);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+
+		fill += len;
+
+		/* Saving, only write full transfers until the stream ends */
+		if (to_file && len && fill < s->bufsize)
+			continue;
+		if (!fill)
+			break;
+
+		aligned = to_file && !len ?
+			  fill & ~(size_t)(DIRECT_ALIGN - 1) : fill;
+
+		ret = write_all(out, buf, aligned);
+		if (!ret && aligned < fill) {
+			fcntl(file, F_SETFL, flags);
+			ret = write_all(out, buf + aligned, fill - aligned);
+		}
+		if (ret)
+			break;
+
+		s->bytes += fill;
+		fill = 0;
+
+		if (!len)
+			break;
+	}
+
+	fcntl(file, F_SETFL, flags);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Try each method in turn unless one was forced.  A method may only be
+ * abandoned before it has written anything out, for the restore the file
+ * is simply rewound.
+ */
+static int stream(struct snapshot *s, int in, int out, bool to_file)
+{
+	enum method method = s->force_method >= 0 ? s->force_method : 0;
+	int ret = -EINVAL;
+
+	for (; method < NR_METHODS; method++) {
+		s->bytes = 0;
+		if (!to_file)
+			lseek(in, 0, SEEK_SET);
+
+		switch (method) {
+		case METHOD_SPLICE:
+			ret = stream_splice(s, in, out);
+			break;
+		default:
+			ret = stream_direct(s, in, out, to_file);
+			break;
+		}
+
+		s->method = method;
+
+		if (!ret || s->force_method >= 0 || s->bytes ||
+		    (ret != -EINVAL && ret != -EOPNOTSUPP && ret != -EBADF))
+			return ret;
+	}
+
+	return ret;
+}
+
+static void mig_running(int device)
+{
+	if (vfio_mig_set_state(device, VFIO_DEVICE_STATE_RUNNING, NULL) &&
+	    !vfio_mig_set_state(device, VFIO_DEVICE_STATE_STOP, NULL))
+		vfio_mig_set_state(device, VFIO_DEVICE_STATE_RUNNING, NULL);
+}
+
+/* RUNNING -> STOP -> STOP_COPY, stream to the file and sync it */
+static void *save_func(void *arg)
+{
+	struct snapshot *s = arg;
+	unsigned long before = now_nsec();
+	int data_fd, file;
+
+	file = open(s->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (file < 0) {
+		printf("%s: failed to open %s: %m\n", s->name, s->path);
+		s->ret = -errno;
+		return NULL;
+	}
+
+	s->ret = vfio_mig_set_state(s->device, VFIO_DEVICE_STATE_STOP, NULL);
+	if (!s->ret)
+		s->ret = vfio_mig_set_state(s->device,
+					    VFIO_DEVICE_STATE_STOP_COPY,
+					    &data_fd);
+	if (s->ret) {
+		printf("%s: failed to enter STOP_COPY: %s\n",
+		       s->name, strerror(-s->ret));
+		goto out;
+	}
+
+	s->ret = stream(s, data_fd, file, true);
+	if (!s->ret && fdatasync(file))
+		s->ret = -errno;
+	s->save_nsecs = now_nsec() - before;
+	close(data_fd);
+
+	if (s->ret)
+		printf("%s: save failed: %s\n", s->name, strerror(-s->ret));
+
+out:
+	close(file);
+	mig_running(s->device);
+	return NULL;
+}
+
+/* STOP -> RESUMING, stream from the file, RESUMING -> STOP loads it */
+static void *restore_func(void *arg)
+{
+	struct snapshot *s = arg;
+	unsigned long before = now_nsec();
+	size_t saved = s->bytes;
+	int data_fd, file;
+
+	file = open(s->path, O_RDONLY);
+	if (file < 0) {
+		printf("%s: failed to open %s: %m\n", s->name, s->path);
+		s->ret = -errno;
+		return NULL;
+	}
+
+	s->ret = vfio_mig_set_state(s->device, VFIO_DEVICE_STATE_STOP, NULL);
+	if (!s->ret)
+		s->ret = vfio_mig_set_state(s->device,
+					    VFIO_DEVICE_STATE_RESUMING,
+					    &data_fd);
+	if (s->ret) {
+		printf("%s: failed to enter RESUMING: %s\n",
+		       s->name, strerror(-s->ret));
+		goto out;
+	}
+
+	s->ret = stream(s, file, data_fd, false);
+	if (!s->ret)
+		s->ret = vfio_mig_set_state(s->device,
+					    VFIO_DEVICE_STATE_STOP, NULL);
+	s->restore_nsecs = now_nsec() - before;
+	close(data_fd);
+
+	if (s->ret)
+		printf("%s: restore failed: %s\n", s->name, strerror(-s->ret));
+	else if (s->bytes != saved)
+		printf("%s: restored %zu of %zu bytes\n",
+		       s->name, s->bytes, saved);
+
+out:
+	close(file);
+	mig_running(s->device);
+	return NULL;
+}
+
+static double mb_per_sec(size_t bytes, unsigned long nsecs)
+{
+	return nsecs ? (double)bytes * NSEC_PER_SEC / nsecs / (1024 * 1024) : 0;
+}
+
+/* Run one phase on every device in parallel, returns the wall time */
+static unsigned long run_phase(struct snapshot *snaps, int nr,
+			       void *(*func)(void *))
+{
+	unsigned long before = now_nsec();
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&snaps[i].thread, NULL, func, &snaps[i])) {
+			printf("Failed to create thread\n");
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		pthread_join(snaps[i].thread, NULL);
+
+	return now_nsec() - before;
+}
+
+static void print_phase(const char *what, struct snapshot *snaps, int nr,
+			unsigned long wall, bool save)
+{
+	size_t total = 0;
+	unsigned long nsecs;
+	int i;
+
+	printf("%s:\n", what);
+	for (i = 0; i < nr; i++) {
+		nsecs = save ? snaps[i].save_nsecs : snaps[i].restore_nsecs;
+		total += snaps[i].bytes;
+		printf("\t%s: %zu bytes, %s%s, %.3fms, %.2f MB/s\n",
+		       snaps[i].name, snaps[i].bytes,
+		       method_names[snaps[i].method],
+		       snaps[i].method == METHOD_DIRECT && !snaps[i].direct ?
+		       " (buffered)" : "", nsecs / 1000000.0,
+		       mb_per_sec(snaps[i].bytes, nsecs));
+	}
+	printf("\tall: %zu bytes, %.3fms wall, %.2f MB/s\n",
+	       total, wall / 1000000.0, mb_per_sec(total, wall));
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	struct snapshot snaps[MAX_DEVICES] = {};
+	const char *dir = ".";
+	size_t bufsize = DEFAULT_BUF_SIZE;
+	int force_method = -1, nr = 0, d, i, opt;
+	unsigned long wall;
+	bool keep = false;
+	uint32_t state;
+
+	while ((opt = getopt(argc, argv, "d:b:m:k")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'b':
+			bufsize = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'm':
+			for (i = 0; i < NR_METHODS; i++)
+				if (!strcmp(optarg, method_names[i]))
+					force_method = i;
+			if (force_method < 0) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'k':
+			keep = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind == argc || argc - optind > MAX_DEVICES || !bufsize ||
+	    bufsize % DIRECT_ALIGN) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (d = optind; d < argc; d++, nr++) {
+		struct snapshot *s = &snaps[nr];
+
+		if (vfio_device_attach(argv[d], NULL, &s->device, NULL))
+			return -1;
+
+		if (vfio_mig_get_state(s->device, &state)) {
+			printf("%s: no migration support\n", argv[d]);
+			return -1;
+		}
+
+		if (state != VFIO_DEVICE_STATE_RUNNING &&
+		    vfio_mig_set_state(s->device, VFIO_DEVICE_STATE_RUNNING,
+				       NULL)) {
+			printf("%s: failed to put device in RUNNING\n",
+			       argv[d]);
+			return -1;
+		}
+
+		s->name = argv[d];
+		s->bufsize = bufsize;
+		s->force_method = force_method;
+		snprintf(s->path, sizeof(s->path), "%s/%s.vfio-state",
+			 dir, argv[d]);
+	}
+
+	wall = run_phase(snaps, nr, save_func);
+	for (i = 0; i < nr; i++)
+		if (snaps[i].ret)
+			return -1;
+	print_phase("Save", snaps, nr, wall, true);
+
+	wall = run_phase(snaps, nr, restore_func);
+	for (i = 0; i < nr; i++)
+		if (snaps[i].ret)
+			return -1;
+	print_phase("Restore", snaps, nr, wall, false);
+
+	if (!keep)
+		for (i = 0; i < nr; i++)
+			unlink(snaps[i].path);
+
+	return 0;
+}
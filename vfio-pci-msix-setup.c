@@ -0,0 +1,238 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define DEFAULT_ROUNDS 5
+
+void usage(char *name)
+{
+	printf("usage: %s [-n rounds] <ssss:bb:dd.f>\n", name);
+	printf("\t-n:   rounds per vector count, default %d\n", DEFAULT_ROUNDS);
+}
+
+struct setup_stats {
+	struct lat_stats enable;
+	struct lat_stats disable;
+	struct lat_stats grow_full;
+	struct lat_stats grow_dynamic;
+};
+
+static int timed_set(int device, unsigned int start, unsigned int count,
+		     int32_t *fds, struct lat_stats *stats)
+{
+	unsigned long before = now_nsec();
+	int ret;
+
+	ret = vfio_irq_set_eventfds(device, VFIO_PCI_MSIX_IRQ_INDEX,
+				    start, count, fds);
+	if (!ret && stats)
+		lat_stats_add(stats, now_nsec() - before);
+
+	return ret;
+}
+
+static int timed_disable(int device, struct lat_stats *stats)
+{
+	unsigned long before = now_nsec();
+	int ret;
+
+	ret = vfio_irq_disable(device, VFIO_PCI_MSIX_IRQ_INDEX);
+	if (!ret && stats)
+		lat_stats_add(stats, now_nsec() - before);
+
+	return ret;
+}
+
+/*
+ * One round for nr vectors: enable and tear down all nr from scratch, then
+ * grow from nr - 1 to nr vectors, first the way a VMM must without dynamic
+ * MSI-X, disabling and re-enabling everything, then by adding only the new
+ * vector.  The latter requires VFIO_IRQ_INFO_NORESIZE to be clear.
+ */
+static int do_round(int device, unsigned int nr, int32_t *fds, bool *dynamic,
+		    struct setup_stats *stats)
+{
+	unsigned long before;
+	int ret;
+
+	ret = timed_set(device, 0, nr, fds, &stats->enable);
+	if (ret) {
+		printf("Failed to enable %u vectors: %s\n", nr, strerror(-ret));
+		return ret;
+	}
+
+	ret = timed_disable(device, &stats->disable);
+	if (ret) {
+		printf("Failed to disable %u vectors: %s\n",
+		       nr, strerror(-ret));
+		return ret;
+	}
+
+	if (nr < 2)
+		return 0;
+
+	ret = timed_set(device, 0, nr - 1, fds, NULL);
+	if (ret)
+		return ret;
+
+	before = now_nsec();
+	ret = timed_disable(device, NULL);
+	if (!ret)
+		ret = timed_set(device, 0, nr, fds, NULL);
+	if (ret) {
+		printf("Failed to re-enable %u vectors: %s\n",
+		       nr, strerror(-ret));
+		return ret;
+	}
+	lat_stats_add(&stats->grow_full, now_nsec() - before);
+
+	timed_disable(device, NULL);
+
+	if (!*dynamic)
+		return 0;
+
+	ret = timed_set(device, 0, nr - 1, fds, NULL);
+	if (ret)
+		return ret;
+
+	ret = timed_set(device, nr - 1, 1, &fds[nr - 1], &stats->grow_dynamic);
+	if (ret) {
+		printf("Dynamic MSI-X allocation failed: %s, skipping\n",
+		       strerror(-ret));
+		*dynamic = false;
+	}
+
+	timed_disable(device, NULL);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	int container, device;
+	int opt, ret;
+	unsigned int i, nr, rounds = DEFAULT_ROUNDS;
+	struct vfio_irq_info irq_info = {
+		.argsz = sizeof(irq_info),
+		.index = VFIO_PCI_MSIX_IRQ_INDEX,
+	};
+	struct setup_stats stats;
+	bool dynamic;
+	int32_t *fds;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !rounds) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	devname = argv[optind];
+
+	if (vfio_device_attach(devname, &container, &device, NULL))
+		return -1;
+
+	ret = ioctl(device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info);
+	if (ret) {
+		printf("VFIO_DEVICE_GET_IRQ_INFO failed: %d (%s)\n",
+		       ret, strerror(errno));
+		return -1;
+	}
+
+	if (!irq_info.count || !(irq_info.flags & VFIO_IRQ_INFO_EVENTFD)) {
+		printf("Device does not support MSI-X\n");
+		return -1;
+	}
+
+	dynamic = !(irq_info.flags & VFIO_IRQ_INFO_NORESIZE);
+
+	printf("MSI-X: %u vectors, %s, %u rounds\n", irq_info.count,
+	       dynamic ? "resizable" : "NORESIZE", rounds);
+
+	fds = calloc(irq_info.count, sizeof(*fds));
+	if (!fds)
+		return -1;
+
+	for (i = 0; i < irq_info.count; i++) {
+		fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (fds[i] < 0) {
+			printf("Failed to create eventfd %u: %m\n", i);
+			return -1;
+		}
+	}
+
+	printf("%8s %12s %12s %12s %12s (avg us)\n", "vectors", "enable",
+	       "disable", "grow full", "grow dynamic");
+
+	/* Powers of two up to and including the maximum */
+	for (nr = 1; ; nr = nr * 2 > irq_info.count ? irq_info.count : nr * 2) {
+		lat_stats_init(&stats.enable, rounds);
+		lat_stats_init(&stats.disable, rounds);
+		lat_stats_init(&stats.grow_full, rounds);
+		lat_stats_init(&stats.grow_dynamic, rounds);
+
+		for (i = 0; i < rounds; i++) {
+			if (do_round(device, nr, fds, &dynamic, &stats))
+				break;
+		}
+
+		printf("%8u %12.3f %12.3f", nr,
+		       lat_stats_avg(&stats.enable) / 1000.0,
+		       lat_stats_avg(&stats.disable) / 1000.0);
+		if (stats.grow_full.count)
+			printf(" %12.3f", lat_stats_avg(&stats.grow_full) / 1000.0);
+		else
+			printf(" %12s", "-");
+		if (stats.grow_dynamic.count)
+			printf(" %12.3f\n",
+			       lat_stats_avg(&stats.grow_dynamic) / 1000.0);
+		else
+			printf(" %12s\n", "-");
+		fflush(stdout);
+
+		lat_stats_free(&stats.enable);
+		lat_stats_free(&stats.disable);
+		lat_stats_free(&stats.grow_full);
+		lat_stats_free(&stats.grow_dynamic);
+
+		if (i < rounds || nr == irq_info.count)
+			break;
+	}
+
+	for (i = 0; i < irq_info.count; i++)
+		close(fds[i]);
+	free(fds);
+
+	return 0;
+}
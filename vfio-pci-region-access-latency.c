@@ -0,0 +1,300 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define DEFAULT_ITERATIONS 10000
+#define MAX_BATCH 64
+#define ACCESS_WINDOW 4096
+#define BULK_WINDOW (1024 * 1024)
+
+void usage(char *name)
+{
+	printf("usage: %s [-b] [-w] [-n iterations] <ssss:bb:dd.f>\n", name);
+	printf("\t-b:   also read BARs without mmap support, reads of device\n"
+	       "\t      registers may have side effects\n");
+	printf("\t-w:   also measure config space writes, these write back\n"
+	       "\t      the read-only vendor and device ID registers\n");
+	printf("\t-n:   accesses per width and batch, default %d\n",
+	       DEFAULT_ITERATIONS);
+}
+
+static const char *region_name(int index)
+{
+	static char name[8];
+
+	switch (index) {
+	case VFIO_PCI_ROM_REGION_INDEX:
+		return "ROM";
+	case VFIO_PCI_CONFIG_REGION_INDEX:
+		return "config";
+	case VFIO_PCI_VGA_REGION_INDEX:
+		return "VGA";
+	}
+
+	snprintf(name, sizeof(name), "BAR%d", index);
+	return name;
+}
+
+/*
+ * The part of a region accesses are made to, the whole region except for
+ * VGA, where vfio-pci only implements the legacy memory and I/O ranges at
+ * their ISA addresses.
+ */
+struct span {
+	const char *name;
+	off_t offset;
+	size_t size;
+};
+
+static const struct span vga_spans[] = {
+	{ "VGA mem", 0xa0000, 0x20000 },
+	{ "VGA io 0x3b0", 0x3b0, 0xc },
+	{ "VGA io 0x3c0", 0x3c0, 0x20 },
+};
+
+/*
+ * Issue iterations accesses of width bytes, batch of them per syscall via
+ * preadv/pwritev, which the vfio read/write handlers service one iovec at a
+ * time.  Offsets walk the first ACCESS_WINDOW bytes of the span.  Writes
+ * are single accesses to its start, storing back the value read there.
+ */
+static int do_accesses(int device, struct span *span,
+		       size_t width, int batch, unsigned long iterations,
+		       bool write)
+{
+	size_t window = span->size < ACCESS_WINDOW ?
+			span->size : ACCESS_WINDOW;
+	struct iovec iov[MAX_BATCH];
+	uint64_t buf[MAX_BATCH];
+	struct lat_stats lat;
+	unsigned long i, before, off = 0;
+	ssize_t ret, len = width * batch;
+	int j;
+
+	if (window < len)
+		return 0;
+
+	for (j = 0; j < batch; j++) {
+		iov[j].iov_base = &buf[j];
+		iov[j].iov_len = width;
+	}
+
+	if (write && pread(device, buf, width, span->offset) != width) {
+		printf("\t%-5s %dB: pread failed: %s\n", "write", (int)width,
+		       strerror(errno));
+		return -1;
+	}
+
+	if (lat_stats_init(&lat, iterations / batch))
+		return -1;
+
+	for (i = 0; i < iterations; i += batch) {
+		before = now_nsec();
+		if (write)
+			ret = pwritev(device, iov, batch, span->offset);
+		else
+			ret = preadv(device, iov, batch, span->offset + off);
+		lat_stats_add(&lat, now_nsec() - before);
+
+		if (ret != len) {
+			printf("\t%-5s %dB x %2d: %s\n", write ? "write" : "read",
+			       (int)width, batch, ret < 0 ? strerror(errno) :
+			       "short access");
+			lat_stats_free(&lat);
+			return -1;
+		}
+
+		off += len;
+		if (off + len > window)
+			off = 0;
+	}
+
+	printf("\t%-5s %dB x %2d: %8.1f ns/access, "
+	       "call p50 %7.3fus p99 %7.3fus max %7.3fus\n",
+	       write ? "write" : "read", (int)width, batch,
+	       (double)lat_stats_avg(&lat) / batch,
+	       lat_stats_pct(&lat, 50) / 1000.0,
+	       lat_stats_pct(&lat, 99) / 1000.0,
+	       lat_stats_pct(&lat, 100) / 1000.0);
+
+	lat_stats_free(&lat);
+	return 0;
+}
+
+/* Repeatedly read up to BULK_WINDOW of the span in chunk sized preads */
+static int do_bulk(int device, struct span *span, size_t chunk)
+{
+	size_t window = span->size < BULK_WINDOW ? span->size : BULK_WINDOW;
+	unsigned long before, nsecs, bytes = 0;
+	size_t off;
+	void *buf;
+	int rounds;
+
+	if (chunk > window)
+		return 0;
+
+	buf = malloc(chunk);
+	if (!buf)
+		return -1;
+
+	before = now_nsec();
+	for (rounds = 0; !rounds || now_nsec() - before < NSEC_PER_SEC / 10;
+	     rounds++) {
+		for (off = 0; off + chunk <= window; off += chunk) {
+			if (pread(device, buf, chunk,
+				  span->offset + off) != chunk) {
+				printf("\tbulk  %7zuB: pread failed at 0x%zx: %s\n",
+				       chunk, off, strerror(errno));
+				free(buf);
+				return -1;
+			}
+			bytes += chunk;
+		}
+	}
+	nsecs = now_nsec() - before;
+
+	printf("\tbulk  %7zuB: %8.2f MB/s\n", chunk, (double)bytes * 1000 / nsecs);
+
+	free(buf);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	int container, device;
+	int i, j, k, l, opt, ret, nr_spans;
+	struct span spans[3];
+	bool bars = false, write = false;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	struct vfio_device_info device_info = {	.argsz = sizeof(device_info) };
+	struct vfio_region_info region_info = { .argsz = sizeof(region_info) };
+	size_t widths[] = { 1, 2, 4, 8 };
+	int batches[] = { 1, 8, MAX_BATCH };
+	size_t chunks[] = { 64, 4096, 64 * 1024, 0 };
+
+	while ((opt = getopt(argc, argv, "bwn:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bars = true;
+			break;
+		case 'w':
+			write = true;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !iterations) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	devname = argv[optind];
+
+	if (vfio_device_attach(devname, &container, &device, NULL))
+		return -1;
+
+	ret = ioctl(device, VFIO_DEVICE_GET_INFO, &device_info);
+	if (ret) {
+		printf("VFIO_DEVICE_GET_INFO failed: %d (%s)\n",
+		       ret, strerror(errno));
+		return -1;
+	}
+
+	if (!(device_info.flags & VFIO_DEVICE_FLAGS_PCI)) {
+		printf("Invalid vfio-pci device\n");
+		return -1;
+	}
+
+	for (i = 0; i <= VFIO_PCI_VGA_REGION_INDEX &&
+	     i < device_info.num_regions; i++) {
+		region_info.index = i;
+		if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &region_info))
+			continue;
+
+		if (!region_info.size ||
+		    !(region_info.flags & VFIO_REGION_INFO_FLAG_READ))
+			continue;
+
+		/* mmap'able BARs only hit this path for sparse mmap holes */
+		if (i <= VFIO_PCI_BAR5_REGION_INDEX &&
+		    (!bars || region_info.flags & VFIO_REGION_INFO_FLAG_MMAP))
+			continue;
+
+		if (i == VFIO_PCI_VGA_REGION_INDEX) {
+			nr_spans = sizeof(vga_spans) / sizeof(vga_spans[0]);
+			for (j = 0; j < nr_spans; j++) {
+				spans[j] = vga_spans[j];
+				spans[j].offset += region_info.offset;
+			}
+		} else {
+			nr_spans = 1;
+			spans[0] = (struct span){
+				.name = region_name(i),
+				.offset = region_info.offset,
+				.size = region_info.size,
+			};
+		}
+
+		for (l = 0; l < nr_spans; l++) {
+			struct span *span = &spans[l];
+
+			printf("%s: size 0x%zx, flags 0x%x\n", span->name,
+			       span->size, region_info.flags);
+
+			for (j = 0; j < sizeof(widths) / sizeof(widths[0]); j++) {
+				for (k = 0; k < sizeof(batches) / sizeof(batches[0]); k++)
+					if (do_accesses(device, span, widths[j],
+							batches[k], iterations,
+							false))
+						break;
+			}
+
+			if (write && i == VFIO_PCI_CONFIG_REGION_INDEX) {
+				/* Stay within the ID registers, command follows */
+				for (j = 0; widths[j] <= 4; j++)
+					do_accesses(device, span, widths[j], 1,
+						    iterations, true);
+			}
+
+			/* Finish with the whole window in a single pread */
+			chunks[sizeof(chunks) / sizeof(chunks[0]) - 1] =
+				span->size < BULK_WINDOW ?
+				span->size : BULK_WINDOW;
+			for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+				if (do_bulk(device, span, chunks[j]))
+					break;
+			}
+		}
+	}
+
+	return 0;
+}
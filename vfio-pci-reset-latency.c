@@ -0,0 +1,292 @@
+/*
+ * VFIO test suite
+ *
+ * Copyright (C) 2012-2025, Red Hat Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/ioctl.h>
+#include <linux/vfio.h>
+
+#include "utils.h"
+
+#define DEFAULT_ITERATIONS 20
+#define MAX_GROUPS 64
+
+void usage(char *name)
+{
+	printf("usage: %s [-a] [-n iterations] <ssss:bb:dd.f>\n", name);
+	printf("\t-a:   time VFIO_DEVICE_RESET with each method the device\n"
+	       "\t      lists in sysfs reset_method, restored afterwards\n");
+	printf("\t-n:   resets per method, default %d\n", DEFAULT_ITERATIONS);
+}
+
+static int sysfs_reset_method(const char *devname, char *buf, size_t len,
+			      const char *set)
+{
+	char path[PATH_MAX];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/reset_method",
+		 devname);
+
+	fd = open(path, set ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (set) {
+		ret = write(fd, set, strlen(set));
+	} else {
+		ret = read(fd, buf, len - 1);
+		if (ret >= 0) {
+			buf[ret] = 0;
+			buf[strcspn(buf, "\n")] = 0;
+		}
+	}
+
+	close(fd);
+	return ret < 0 ? -errno : 0;
+}
+
+static void time_device_reset(int device, const char *name,
+			      unsigned long iterations)
+{
+	struct lat_stats lat;
+	unsigned long i, before;
+
+	lat_stats_init(&lat, iterations);
+
+	for (i = 0; i < iterations; i++) {
+		before = now_nsec();
+		if (ioctl(device, VFIO_DEVICE_RESET)) {
+			printf("\t%s: VFIO_DEVICE_RESET failed: %s\n",
+			       name, strerror(errno));
+			break;
+		}
+		lat_stats_add(&lat, now_nsec() - before);
+	}
+
+	lat_stats_print(name, &lat);
+	fflush(stdout);
+	lat_stats_free(&lat);
+}
+
+static void time_hot_reset(int device, struct vfio_pci_hot_reset *reset,
+			   const char *name, unsigned long iterations)
+{
+	struct lat_stats lat;
+	unsigned long i, before;
+
+	lat_stats_init(&lat, iterations);
+
+	for (i = 0; i < iterations; i++) {
+		before = now_nsec();
+		if (ioctl(device, VFIO_DEVICE_PCI_HOT_RESET, reset)) {
+			printf("\t%s: VFIO_DEVICE_PCI_HOT_RESET failed: %s\n",
+			       name, strerror(errno));
+			break;
+		}
+		lat_stats_add(&lat, now_nsec() - before);
+	}
+
+	lat_stats_print(name, &lat);
+	fflush(stdout);
+	lat_stats_free(&lat);
+}
+
+static void device_reset(const char *devname, int device, bool all_methods,
+			 unsigned long iterations)
+{
+	struct vfio_device_info device_info = { .argsz = sizeof(device_info) };
+	char methods[256], orig[256], *method, *save;
+
+	if (ioctl(device, VFIO_DEVICE_GET_INFO, &device_info) ||
+	    !(device_info.flags & VFIO_DEVICE_FLAGS_RESET)) {
+		printf("VFIO_DEVICE_RESET not supported\n");
+		return;
+	}
+
+	if (sysfs_reset_method(devname, methods, sizeof(methods), NULL))
+		strcpy(methods, "default");
+
+	printf("VFIO_DEVICE_RESET, reset_method: %s\n", methods);
+	strcpy(orig, methods);
+
+	if (!all_methods) {
+		time_device_reset(device, "device reset", iterations);
+		return;
+	}
+
+	for (method = strtok_r(methods, " ", &save); method;
+	     method = strtok_r(NULL, " ", &save)) {
+		if (sysfs_reset_method(devname, NULL, 0, method)) {
+			printf("\t%s: failed to select method\n", method);
+			continue;
+		}
+		time_device_reset(device, method, iterations);
+	}
+
+	/* strtok_r consumed methods, put back the list as we found it */
+	if (sysfs_reset_method(devname, NULL, 0, orig))
+		printf("Failed to restore reset_method \"%s\"\n", orig);
+}
+
+/* Group path, every group with a dependent device must be passed in */
+static void group_hot_reset(const char *devname, int device, int group,
+			    unsigned long iterations)
+{
+	struct vfio_pci_hot_reset_info *info;
+	struct vfio_pci_hot_reset *reset;
+	int groupids[MAX_GROUPS], nr_groups = 0, own_id = -1, groupid;
+	char path[PATH_MAX];
+	int i, j;
+
+	groupid = vfio_device_get_groupid(devname);
+	if (groupid < 0)
+		return;
+
+	info = vfio_pci_hot_reset_info(device);
+	if (!info) {
+		printf("Hot reset not supported\n");
+		return;
+	}
+
+	reset = calloc(1, sizeof(*reset) + MAX_GROUPS * sizeof(int32_t));
+	if (!reset)
+		goto out;
+
+	for (i = 0; i < info->count; i++) {
+		for (j = 0; j < nr_groups; j++)
+			if (groupids[j] == info->devices[i].group_id)
+				break;
+		if (j < nr_groups || nr_groups == MAX_GROUPS)
+			continue;
+		groupids[nr_groups++] = info->devices[i].group_id;
+	}
+
+	/* Our own group is already open, the others must be available */
+	for (i = 0; i < nr_groups; i++) {
+		if (groupids[i] == groupid) {
+			reset->group_fds[i] = group;
+			own_id = i;
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/dev/vfio/%d", groupids[i]);
+		reset->group_fds[i] = open(path, O_RDWR);
+		if (reset->group_fds[i] < 0) {
+			printf("Failed to open %s: %s\n", path, strerror(errno));
+			goto out_close;
+		}
+	}
+
+	reset->argsz = sizeof(*reset) + nr_groups * sizeof(int32_t);
+	reset->count = nr_groups;
+
+	printf("VFIO_DEVICE_PCI_HOT_RESET, %d dependent devices in %d groups\n",
+	       info->count, nr_groups);
+	time_hot_reset(device, reset, "group fds", iterations);
+
+out_close:
+	for (j = 0; j < i; j++)
+		if (j != own_id)
+			close(reset->group_fds[j]);
+out:
+	free(reset);
+	free(info);
+}
+
+/* iommufd path, a zero-length array proves ownership through the iommufd */
+static void iommufd_hot_reset(const char *devname, unsigned long iterations)
+{
+	struct vfio_pci_hot_reset_info *info;
+	struct vfio_pci_hot_reset reset = { .argsz = sizeof(reset) };
+	int iommufd, device;
+
+	iommufd = iommufd_open();
+	if (iommufd < 0)
+		return;
+
+	if (vfio_device_iommufd_attach(devname, iommufd, &device, NULL))
+		goto out_iommufd;
+
+	info = vfio_pci_hot_reset_info(device);
+	if (!info) {
+		printf("Hot reset not supported\n");
+		goto out_device;
+	}
+
+	if (!(info->flags & VFIO_PCI_HOT_RESET_FLAG_DEV_ID_OWNED)) {
+		printf("iommufd hot reset: dependent devices not owned, skipping\n");
+		goto out_info;
+	}
+
+	printf("VFIO_DEVICE_PCI_HOT_RESET, iommufd, %d dependent devices\n",
+	       info->count);
+	time_hot_reset(device, &reset, "zero-length", iterations);
+
+out_info:
+	free(info);
+out_device:
+	close(device);
+out_iommufd:
+	close(iommufd);
+}
+
+int main(int argc, char **argv)
+{
+	const char *devname;
+	int container, group, device, opt;
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	bool all_methods = false;
+
+	while ((opt = getopt(argc, argv, "an:")) != -1) {
+		switch (opt) {
+		case 'a':
+			all_methods = true;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || !iterations) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	devname = argv[optind];
+
+	if (vfio_device_attach(devname, &container, &device, &group))
+		return -1;
+
+	device_reset(devname, device, all_methods, iterations);
+	group_hot_reset(devname, device, group, iterations);
+
+	/* The cdev can't bind while the group is in use */
+	close(device);
+	close(group);
+	close(container);
+
+	iommufd_hot_reset(devname, iterations);
+
+	return 0;
+}